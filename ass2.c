@@ -2,51 +2,525 @@
  *	Copyright (C) 2017  Hannes Haberl
  *	                    Matthias Tamegger
  */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 
 #define OPTION_COUNT 2
+#define HEADER_LINE_COUNT (OPTION_COUNT + 1)
+#define CONTENT_HASH_SEED 0x9E3779B97F4A7C15ULL
 #define MAP_MALLOC_INTERVALL 64
+#define MAP_MAX_LOAD_PERCENT 75
+#define WORKLIST_MALLOC_INTERVALL 64
+#define PREFETCH_MALLOC_INTERVALL 64
 #define FILE_BUFFER_SIZE 128
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define REPLAY_BUFFER_SIZE (64 * 1024)
+#define SESSION_MALLOC_INTERVALL 1024
+#define SERVER_EVENT_COUNT 256
+#define SERVER_INPUT_SIZE 4096
+#define GENERATOR_PATH_SIZE 4096
+#define PARENT_MALLOC_INTERVALL 4
+#define WATCH_BUFFER_SIZE 4096
+#define NO_END_DISTANCE UINT32_MAX
+#define TEXT_BLOCK_SIZE (16 * 1024)
+#define TEXT_CACHE_SIZE 4
+#define TEXT_DICTIONARY_SIZE (16 * 1024)
+
+// The parts of the output of a Chapter, besides title and text
+#define FRAME_SEPARATOR "------------------------------\n"
+#define FRAME_PROMPT "Deine Wahl (A/B)? "
+#define FRAME_END "ENDE\n"
+#define FRAME_INVALID_CHOICE "[ERR] Please enter A or B.\n"
 
 #define ERR_INVALID_ARGUMENTS 1
 #define ERR_OUT_OF_MEMORY 2
 #define ERR_IO 3
+#define ERR_WRITE 4
+#define ERR_SERVE 5
+
+// Flags for loading the chapter files
+#define LOAD_MAPPED 1
+
+// Flags for replaying sessions
+#define REPLAY_QUIET 1
+
+// Flags for scanning chapter files
+#define SCAN_HASH 1
+
+// The result of the game graph analysis
+typedef enum _GraphClass_
+{
+  POSSIBLE = 1,
+  HAS_MAZE = 2,
+  NO_END = 0
+} GraphClass;
 
 // Only needed for the game graph analysis
 typedef enum _GraphNodeStatus_
 {
-  DEAD_END = -1,    // Node is adjacent to two currently processing nodes,
-  // this state exists to decrease recursion
+  DEAD_END = -1,    // Node was visited and can't reach an end
   UNVISITED = 0,    // Node is not processed yet
-  PROCESSING = 1,   // Node is currently being processed
+  PROCESSING = 1,   // Node is on the stack of the current components
   LEADS_TO_END = 2  // Node was visited and leads to an end
 } GraphNodeStatus;
 
+// A block of an Arena, its memory follows the header
+typedef struct _ArenaBlock_
+{
+  struct _ArenaBlock_ *previous_block_;
+  size_t size_;
+  size_t used_;
+} ArenaBlock;
+
+// A bump allocator. All allocations are released at once by releaseArena.
+typedef struct _Arena_
+{
+  ArenaBlock *current_block_;
+} Arena;
+
+// A not null terminated string, pointing into a larger buffer
+typedef struct _StringView_
+{
+  char *start_;
+  size_t length_;
+} StringView;
+
+// The result of scanContent, the positions are NULL if they were not found
+typedef struct _ContentScan_
+{
+  char *new_lines_[HEADER_LINE_COUNT];  // The ends of the header lines
+  size_t new_line_count_;
+  char *first_null_;
+  unsigned long long hash_;             // Only set with SCAN_HASH
+} ContentScan;
+
+// The compressed frames of consecutive Chapters, see compressStoryText
+typedef struct _TextBlock_
+{
+  unsigned char *data_;
+  size_t compressed_length_;
+  size_t length_;
+  struct _TextStore_ *store_;
+} TextBlock;
+
+// The compressed frames of a story and the cache of the last decompressed
+// blocks. Every cache buffer starts with a copy of the dictionary, which the
+// blocks can refer to, followed by the decompressed block.
+typedef struct _TextStore_
+{
+  unsigned char *dictionary_;
+  size_t dictionary_length_;
+  TextBlock *blocks_;
+  size_t block_count_;
+  unsigned char *cache_buffers_[TEXT_CACHE_SIZE];
+  TextBlock *cached_blocks_[TEXT_CACHE_SIZE];
+  size_t cache_uses_[TEXT_CACHE_SIZE];
+  size_t use_count_;
+} TextStore;
+
 typedef struct _Chapter_
 {
   char *title_;
+  size_t title_length_;
   char *text_;
+  size_t text_length_;
   struct _Chapter_ *options_[OPTION_COUNT];
 
+  // The complete output of the Chapter, rendered once at load time. NULL if
+  // the Chapter is printed from title_ and text_, e.g. for mapped files.
+  char *frame_;
+  size_t frame_length_;
+
+  // The file content into which title_ and text_ point. It is either owned
+  // by an Arena or, if is_mapped_ is set, a read only mapping of the file.
+  char *content_;
+  size_t content_length_;
+  int is_mapped_;
+
+  // Fingerprint of the file content, needed for the duplicate detection
+  unsigned long long content_hash_;
+
+  // Set if the frame was compressed by compressStoryText, it is then the
+  // frame_length_ bytes at frame_offset_ of the decompressed block
+  TextBlock *text_block_;
+  size_t frame_offset_;
+
   // Needed for the game graph analysis
   GraphNodeStatus graph_analyze_state_;
+  size_t graph_index_;
+
+  // The Chapters with an option to this one, only maintained while the
+  // chapter files are watched
+  struct _Chapter_ **parents_;
+  size_t parent_count_;
+  size_t parent_length_;
+
+  // The number of options that are queued but not assigned yet. A Chapter
+  // without options and without pending options is an end.
+  int pending_option_count_;
 } Chapter;
 
+// The story graph in compressed sparse row form, built after loading. Node i
+// is the Chapter numbered i by numberChapters, its options are the nodes
+// edges_[edge_starts_[i]] up to edges_[edge_starts_[i + 1] - 1], so ends have
+// no edges and the number of options can vary. The analysis state of the
+// nodes is kept apart from the Chapters in node_states_.
+// The predecessors of node i are stored the same way in predecessors_, they
+// are needed to find the distances to the ends, see computeEndDistances.
+typedef struct _StoryGraph_
+{
+  uint32_t node_count_;
+  uint32_t *edge_starts_;         // node_count_ + 1 entries
+  uint32_t *edges_;
+  uint32_t *predecessor_starts_;  // node_count_ + 1 entries
+  uint32_t *predecessors_;
+  Chapter **chapters_;
+  signed char *node_states_;      // The GraphNodeStatus of every node
+  // The strongly connected component of every node. They are numbered in
+  // the order traverseStoryGraph finishes them, so every edge between two
+  // components leads to a smaller number.
+  uint32_t *components_;
+  uint32_t component_count_;
+  // The fewest choices to an end or NO_END_DISTANCE, and the option which
+  // leads there
+  uint32_t *end_distances_;
+  unsigned char *best_options_;
+} StoryGraph;
+
+// The physical file behind a path, so every file is read only once no matter
+// if it is referenced relative, absolute or through a symlink
+typedef struct _FileIdentity_
+{
+  dev_t device_;
+  ino_t inode_;
+  // Change when the file is written, see writeStoryCache
+  off_t size_;
+  struct timespec modified_;
+  // Not set if the file could not be examined
+  int is_valid_;
+} FileIdentity;
+
 typedef struct _MapEntry_
 {
   char *key_;
+  size_t key_length_;
+  size_t key_hash_;
   Chapter *value_;
+  // Set for the first entry of a Chapter, only this entry frees it
+  int owns_value_;
+  FileIdentity file_identity_;
 } MapEntry;
 
+// A slot of the open addressing index. entry_index_ is the position of the
+// entry in start_entry_ plus one, so 0 marks an empty slot.
+typedef struct _MapBucket_
+{
+  size_t key_hash_;
+  size_t entry_index_;
+} MapBucket;
+
 typedef struct _Map_
 {
+  // Entries in insertion order
   size_t length_;
   size_t count_;
   MapEntry *start_entry_;
+
+  // Hash indices over the entries, bucket_count_ is always a power of two.
+  // buckets_ is keyed by the filename, content_buckets_ by the content hash
+  // of the Chapter and only holds the first entry of every unique Chapter.
+  // file_buckets_ is keyed by the FileIdentity of the entries with a valid
+  // one.
+  size_t bucket_count_;
+  MapBucket *buckets_;
+  MapBucket *content_buckets_;
+  MapBucket *file_buckets_;
+
+  // Own all Chapters and their file contents. The Chapters are kept apart
+  // from the contents, so they lie close together during play and analysis.
+  Arena chapter_arena_;
+  Arena text_arena_;
+
+  // LOAD_ flags, which determine how the chapter files are loaded
+  int load_flags_;
+  // Number of threads which read the chapter files in advance, 0 loads all
+  // files on the calling thread
+  size_t load_thread_count_;
+  struct _Prefetcher_ *prefetcher_;
+  // Set if the story is played while it is loaded, see playLazily
+  struct _LazyLoader_ *lazy_loader_;
+
+  // The graph of the unique Chapters, built by analyzeGameGraph. It is not
+  // updated when the Watcher reloads chapter files.
+  StoryGraph graph_;
+  // The compressed frames of the Chapters with --compress, else NULL
+  TextStore *text_store_;
 } Map;
 
+typedef enum _PrefetchState_
+{
+  PREFETCH_QUEUED = 0,   // File is waiting for a thread to read it
+  PREFETCH_LOADING = 1,  // File is currently read
+  PREFETCH_DONE = 2,     // Content or error is available
+  PREFETCH_TAKEN = 3     // Content was handed to the loader
+} PrefetchState;
+
+// A chapter file which is read in advance by the Prefetcher
+typedef struct _PrefetchEntry_
+{
+  char *path_;
+  size_t path_length_;
+  size_t path_hash_;
+  PrefetchState state_;
+
+  // The result of loadChapterText, valid if the state is PREFETCH_DONE
+  char *content_;
+  size_t content_length_;
+  int is_mapped_;
+  unsigned long long content_hash_;
+  int error_;
+
+  struct _PrefetchEntry_ *next_queued_;
+} PrefetchEntry;
+
+// A thread of the Prefetcher, it reads files into its own Arena
+typedef struct _PrefetchThread_
+{
+  struct _Prefetcher_ *prefetcher_;
+  thrd_t thread_;
+  Arena arena_;
+} PrefetchThread;
+
+// A thread pool which reads the chapter files ahead of the loader. Read files
+// are parsed for their options, which are queued in turn, so the threads
+// discover the story on their own. All members are guarded by lock_.
+typedef struct _Prefetcher_
+{
+  mtx_t lock_;
+  cnd_t work_available_;
+  cnd_t work_done_;
+  int stop_;
+  int load_flags_;
+
+  // Hash index of all entries, keyed by the path
+  size_t entry_count_;
+  size_t slot_count_;
+  PrefetchEntry **slots_;
+
+  // Entries in the state PREFETCH_QUEUED, first in first out
+  PrefetchEntry *first_queued_;
+  PrefetchEntry *last_queued_;
+
+  size_t thread_count_;
+  PrefetchThread *threads_;
+
+  // The Arena of the loader, used if it reads a file itself
+  Arena *loader_arena_;
+} Prefetcher;
+
+// Loads and analyzes a story on a background thread while it is already
+// played. The loader publishes the start Chapter and every assigned option,
+// the player waits only for options it needs. start_chapter_, is_finished_,
+// error_ and the options of the loaded Chapters are guarded by lock_.
+typedef struct _LazyLoader_
+{
+  mtx_t lock_;
+  cnd_t chapter_loaded_;
+  thrd_t thread_;
+  int has_thread_;
+  Map *map_;
+  char *start_file_;
+  Chapter *start_chapter_;
+  int is_finished_;
+  int error_;
+} LazyLoader;
+
+// An option of a loaded Chapter, whose Chapter still has to be assigned
+typedef struct _PendingOption_
+{
+  Chapter *chapter_;
+  int option_index_;
+  StringView filename_;
+} PendingOption;
+
+// A stack of PendingOptions, the last pushed option is loaded first
+typedef struct _Worklist_
+{
+  size_t length_;
+  size_t count_;
+  PendingOption *start_option_;
+} Worklist;
+
+// What the program does with the start file
+typedef enum _RunMode_
+{
+  RUN_PLAY = 0,     // Load the story and play it
+  RUN_COMPILE = 1,  // Load the story and write it into a pack file
+  RUN_PACK = 2,     // Play the story of a pack file
+  RUN_GENERATE = 3, // Generate a synthetic story into the start directory
+  RUN_BENCHMARK = 4, // Load, analyze, play and free the story with timing
+  RUN_PATHS = 5      // Load the story and count its playthroughs
+} RunMode;
+
+// The parsed command line arguments
+typedef struct _Arguments_
+{
+  RunMode run_mode_;
+  char *start_file_;
+  char *pack_file_;
+  int load_flags_;
+  size_t load_thread_count_;
+  char *replay_file_;
+  int replay_flags_;
+  char *socket_file_;
+  int watch_files_;
+  int lazy_loading_;
+  int auto_play_;
+  int compress_text_;
+  int use_cache_;
+  char *story_shape_;
+  size_t benchmark_turn_count_;
+  int print_statistics_;
+} Arguments;
+
+// The timed phases of the program
+typedef enum _StatisticsPhase_
+{
+  PHASE_LOAD = 0,
+  PHASE_ANALYSIS = 1,
+  PHASE_COMPRESSION = 2,
+  PHASE_PLAY = 3,
+  PHASE_TEARDOWN = 4,
+  PHASE_COUNT = 5
+} StatisticsPhase;
+
+// The phase times and counters printed with --stats. The counters are
+// atomic, because the prefetch threads read files too.
+typedef struct _Statistics_
+{
+  int enabled_;
+  unsigned measured_phases_;
+  double phase_start_wall_;
+  double phase_start_cpu_;
+  double wall_seconds_[PHASE_COUNT];
+  double cpu_seconds_[PHASE_COUNT];
+  atomic_size_t files_opened_;
+  atomic_size_t bytes_read_;
+  atomic_size_t read_resizes_;
+  atomic_size_t map_probes_;
+  atomic_size_t identity_hits_;
+  atomic_size_t content_compares_;
+  atomic_size_t graph_visits_;
+  atomic_size_t text_stored_;
+  atomic_size_t text_compressed_;
+  atomic_size_t block_decodes_;
+} Statistics;
+
+// The shape of a generated story. The Chapters are split into depth_ layers,
+// the options of a Chapter lead into the next layer, the last layer ends.
+typedef struct _StoryShape_
+{
+  size_t chapter_count_;
+  size_t depth_;
+  unsigned overlap_percent_;    // Both options lead to the same Chapter
+  unsigned cycle_percent_;      // An option leads back to an earlier layer
+  unsigned duplicate_percent_;  // A file repeats the previous one's content
+  size_t text_size_;
+  unsigned long long seed_;
+  size_t *layer_starts_;        // The first Chapter of every layer and the
+                                // Chapter count
+} StoryShape;
+
+// The states of reading a choice line, the choices are their option index
+typedef enum _ChoiceState_
+{
+  CHOICE_INVALID = -3,
+  CHOICE_BEGIN = -2,
+  CHOICE_A = 0,
+  CHOICE_B = 1
+} ChoiceState;
+
+// What a ServerSession still has to send
+typedef enum _SessionOutput_
+{
+  OUTPUT_NONE = 0,
+  OUTPUT_FRAME = 1,  // The frame of the current Chapter
+  OUTPUT_ERROR = 2   // The message for an invalid choice
+} SessionOutput;
+
+// A player connected to the server. The input stays in the socket until it
+// is processed and the output is read from the Chapter, so only the
+// positions in the story and in the output are stored.
+typedef struct _ServerSession_
+{
+  Chapter *chapter_;
+  size_t output_offset_;
+  int8_t output_;
+  int8_t choice_state_;
+  int8_t watches_output_;
+} ServerSession;
+
+// Reloads the chapter files of a Map when they are changed on disk
+typedef struct _Watcher_
+{
+  int inotify_fd_;
+  Map *map_;
+  // The inotify watch of the directory of every map entry, -1 if none
+  int *entry_watches_;
+  size_t entry_watch_count_;
+  // The number of unique Chapters in state DEAD_END
+  size_t dead_end_count_;
+  size_t search_mark_;
+  GraphClass graph_class_;
+} Watcher;
+
+// The server for multiple sessions, which share the immutable story
+typedef struct _Server_
+{
+  int listen_fd_;
+  int epoll_fd_;
+  Chapter *start_chapter_;
+  ServerSession *sessions_;  // Indexed by file descriptor
+  size_t session_length_;
+  Watcher *watcher_;         // NULL if the chapter files are not watched
+} Server;
+
+// The state of a session while it is replayed
+typedef struct _ReplaySession_
+{
+  Chapter *chapter_;
+  size_t turn_count_;
+  size_t invalid_count_;
+} ReplaySession;
+
+
+// The statistics of this run, only collected if enabled_ is set
+static Statistics statistics;
 
 typedef struct list
 {
@@ -54,59 +528,196 @@ typedef struct list
   struct list *cdf;
 } CoolList;
 
+void parseArguments(int, char *[], Arguments *, int *);
+
 void initializeMap(Map *, int *);
 
 size_t createMapEntryArray(MapEntry **, size_t, int *);
 
 size_t resizeMap(Map *, size_t, int *);
 
-Chapter *getChapterFromMap(Map *, char *);
+void createMapBuckets(Map *, size_t, int *);
+
+void insertMapBucket(MapBucket *, size_t, size_t, size_t);
+
+size_t hashFilename(StringView);
+
+FileIdentity getFileIdentity(char *);
+
+size_t hashFileIdentity(FileIdentity);
+
+Chapter *getChapterFromFileIdentity(Map *, FileIdentity);
+
+unsigned long long hashContent(char *, size_t);
+
+unsigned long long mixContentHash(unsigned long long, char *, size_t);
+
+unsigned long long finishContentHash(unsigned long long);
+
+Chapter *getEqualChapter(Map *, Chapter *);
 
-Chapter *insertChapterIntoMap(Map *, char *, Chapter *, int *);
+Chapter *getChapterFromMap(Map *, StringView);
+
+Chapter *insertChapterIntoMap(Map *, StringView, FileIdentity, Chapter *,
+                              int *);
 
 void freeMap(Map *);
 
-void createChapter(Chapter **, int *);
+void createChapter(Arena *, Chapter **, int *);
 
 int areEqual(Chapter *, Chapter *);
 
-void loadAndAssignOptions(Chapter *, char *[OPTION_COUNT], Map *, int *);
+void queueOptions(Chapter *, StringView[OPTION_COUNT], Worklist *, int *);
+
+void pushPendingOption(Worklist *, PendingOption, int *);
+
+void loadPendingOptions(Worklist *, Map *, int *);
+
+void validateOptions(StringView[OPTION_COUNT], int *);
+
+void freeChapter(Map *, Chapter *);
+
+void freeChapterContent(Chapter *);
+
+void freeEntry(Map *, MapEntry *);
+
+void *allocateFromArena(Arena *, size_t, int *);
+
+void *resizeArenaAllocation(Arena *, void *, size_t, size_t, int *);
+
+void freeArenaAllocation(Arena *, void *, size_t);
+
+void mergeArena(Arena *, Arena *);
+
+void releaseArena(Arena *);
+
+void getChapterPropertiesFromText(char *, size_t, StringView *, StringView *,
+                                  StringView[OPTION_COUNT],
+                                  unsigned long long *, int *);
+
+void scanContent(char *, size_t, int, ContentScan *);
+
+void copyStringView(StringView, char **, int *);
+
+void loadChapterText(char *, int, Arena *, char **, size_t *, int *, int *);
+
+void mapChapterText(char *, char **, size_t *, int *);
+
+void readFile(FILE *, Arena *, char **, size_t, size_t *, int *);
+
+size_t getFileSize(FILE *);
+
+int isEndOption(StringView);
+
+int isOptionValid(StringView);
+
+GraphClass analyzeGameGraph(Map *map, int *error);
+
+void freeStoryGraph(StoryGraph *);
+
+size_t numberChapters(Map *);
+
+void printGraphClass(GraphClass);
+
+void writePack(Map *, GraphClass, char *, int *);
+
+void countStoryPaths(Map *, int *);
+
+void compressStoryText(Map *, int *);
+
+char *getTextBlock(TextBlock *);
+
+void freeTextStore(TextStore *);
+
+int writePackData(Map *, GraphClass, FILE *, int *);
+
+void playPack(Arguments *, int *);
 
-void validateOptions(char *[OPTION_COUNT], int *);
+int playCachedStory(Arguments *, int *);
 
-void freeChapter(Chapter *);
+void writeStoryCache(Map *, GraphClass, char *, time_t, int *);
 
-void freeEntry(MapEntry *);
+void playStory(Chapter *, Map *, Arguments *, int *);
 
-size_t createCharArray(char **, size_t, int *);
+void startGame(Chapter *, LazyLoader *);
 
-void getChapterPropertiesFromText(char *, char **, char **,
-                                  char *[OPTION_COUNT], int *);
+void startGraphGame(StoryGraph *);
 
-void loadChapterText(char *, char **, int *);
+void startAutoGame(StoryGraph *);
 
-void readFile(FILE *, char **, int *);
+void replaySessions(Chapter *, char *, int, int *);
 
-void findAndReplaceNewLine(char **, int *);
+void serveStory(Chapter *, Map *, char *, int *);
 
-int isEndOption(char *);
+void startWatcher(Watcher *, Map *, int, int *);
 
-int isOptionValid(char *);
+void stopWatcher(Watcher *);
 
-void analyzeGameGraph(Map *map, int *error);
+void handleWatchEvents(Watcher *);
 
-void startGame(Chapter *);
+void generateStory(char *, char *, int *);
 
-int playChapter(Chapter **);
+void runBenchmark(Map *, Arguments *, int *);
+
+int playChapter(Chapter **, LazyLoader *);
+
+void renderChapterFrame(Arena *, Chapter *, int, int *);
+
+void writeChapterFrame(Chapter *);
+
+char *getChapterTitle(Chapter *);
 
 int getChoice();
 
+int readValidChoice();
+
+ChoiceState readChoiceCharacter(ChoiceState, int);
+
+int getChapterFramePieces(Chapter *, struct iovec *);
+
 void initializeWithFile(char *, Map *, Chapter **, int *);
 
-void loadChapterFromFile(char *, Map *, Chapter **, int *);
+void loadChapterFromFile(StringView, Map *, Worklist *, Chapter **, int *);
+
+void startPrefetcher(Prefetcher *, StringView, Map *, int *);
+
+void stopPrefetcher(Prefetcher *);
+
+int runPrefetchThread(void *);
+
+void playLazily(Map *, char *, int *);
+
+int runLazyLoader(void *);
+
+Chapter *waitForLazyOption(LazyLoader *, Chapter *, int);
+
+int isLazyEnd(LazyLoader *, Chapter *);
+
+void publishLazyStart(LazyLoader *, Chapter *);
+
+void publishLazyOption(LazyLoader *, PendingOption, Chapter *);
+
+PrefetchEntry *getPrefetchEntry(Prefetcher *, StringView, int *);
+
+void loadPrefetchEntry(Prefetcher *, PrefetchEntry *, Arena *);
+
+void takePrefetchedText(Prefetcher *, StringView, char **, size_t *, int *,
+                        unsigned long long *, int *);
 
 void printError(int, char *);
 
+void startPhase();
+
+void finishPhase(StatisticsPhase);
+
+void countStatistic(atomic_size_t *, size_t);
+
+void printStatistics();
+
+double getSeconds();
+
+double getCpuSeconds();
+
 //------------------------------------------------------------------------------
 ///
 /// This is a small Text Adventure using a file structure as level design.
@@ -117,35 +728,298 @@ void printError(int, char *);
 int main(int argc, char *argv[])
 {
   // Basic argument validation
-  if (argc != 2)
+  Arguments arguments;
+  int error = 0;
+  parseArguments(argc, argv, &arguments, &error);
+  if (error)
   {
-    printError(ERR_INVALID_ARGUMENTS, NULL);
-    return ERR_INVALID_ARGUMENTS;
+    printError(error, NULL);
+    return error;
   }
-  char *start_file = argv[1];
+  char *start_file = arguments.start_file_;
 
   // Initialize
   Chapter *start_chapter = NULL;
   Map options_map = {
       .length_ = MAP_MALLOC_INTERVALL,
-      .count_ = 0
+      .count_ = 0,
+      .start_entry_ = NULL,
+      .bucket_count_ = 0,
+      .buckets_ = NULL,
+      .content_buckets_ = NULL,
+      .file_buckets_ = NULL,
+      .chapter_arena_ = {NULL},
+      .text_arena_ = {NULL},
+      .load_flags_ = arguments.load_flags_,
+      .load_thread_count_ = arguments.load_thread_count_,
+      .prefetcher_ = NULL,
+      .lazy_loader_ = NULL,
+      .text_store_ = NULL
   };
-  int error = 0;
-  initializeWithFile(start_file, &options_map, &start_chapter, &error);
-  analyzeGameGraph(&options_map, &error);
-  if (!error)
+  statistics.enabled_ = arguments.print_statistics_;
+  if (arguments.run_mode_ == RUN_PACK)
+  {
+    playPack(&arguments, &error);
+  }
+  else if (arguments.run_mode_ == RUN_GENERATE)
+  {
+    generateStory(arguments.story_shape_, start_file, &error);
+  }
+  else if (arguments.run_mode_ == RUN_BENCHMARK)
   {
-    startGame(start_chapter);
+    runBenchmark(&options_map, &arguments, &error);
   }
-  freeMap(&options_map);
+  else if (arguments.lazy_loading_)
+  {
+    playLazily(&options_map, start_file, &error);
+    startPhase();
+    freeMap(&options_map);
+    finishPhase(PHASE_TEARDOWN);
+  }
+  else if (!playCachedStory(&arguments, &error) && !error)
+  {
+    time_t load_start = time(NULL);
+    startPhase();
+    initializeWithFile(start_file, &options_map, &start_chapter, &error);
+    finishPhase(PHASE_LOAD);
+    GraphClass graph_class = analyzeGameGraph(&options_map, &error);
+    if (arguments.use_cache_)
+    {
+      writeStoryCache(&options_map, graph_class, start_file, load_start,
+                      &error);
+    }
+    finishPhase(PHASE_ANALYSIS);
+    if (arguments.compress_text_)
+    {
+      compressStoryText(&options_map, &error);
+      finishPhase(PHASE_COMPRESSION);
+    }
+    if (!error)
+    {
+      if (arguments.run_mode_ == RUN_COMPILE)
+      {
+        writePack(&options_map, graph_class, arguments.pack_file_, &error);
+      }
+      else if (arguments.run_mode_ == RUN_PATHS)
+      {
+        countStoryPaths(&options_map, &error);
+        finishPhase(PHASE_ANALYSIS);
+      }
+      else
+      {
+        playStory(start_chapter, &options_map, &arguments, &error);
+        finishPhase(PHASE_PLAY);
+      }
+    }
+    startPhase();
+    freeMap(&options_map);
+    finishPhase(PHASE_TEARDOWN);
+  }
+  printStatistics();
   printError(error, NULL);
   return error;
 }
 
+//-----------------------------------------------------------------------------
+///
+/// Parses the command line arguments. Exactly one start file is needed, it
+/// can be preceded or followed by these options:
+/// --mmap         Map the chapter files read only instead of copying them.
+/// --threads <n>  Read the chapter files with n threads in advance and
+///                analyze the story with n threads.
+/// --compile      Write the story into the pack file given after the start
+///                file instead of playing it.
+/// --pack         The start file is a pack file, which is played.
+/// --paths        Count the playthroughs to every ending instead of playing,
+///                see countStoryPaths.
+/// --replay <f>   Replay the sessions of file f instead of reading choices
+///                from stdin, see replaySessions.
+/// --quiet        Do not print the Chapters while replaying.
+/// --serve <s>    Serve the story to many players on the Unix domain socket
+///                s, see serveStory.
+/// --watch        Reload changed chapter files while serving, see
+///                handleWatchEvents.
+/// --lazy         Start playing as soon as the start file is loaded and load
+///                the rest of the story meanwhile, see playLazily.
+/// --auto         Play without reading choices, always taking the shortest
+///                way to an end, see startAutoGame.
+/// --compress     Keep the chapter texts compressed while playing, see
+///                compressStoryText.
+/// --no-cache     Neither use nor write the cache of the story next to the
+///                start file, see playCachedStory.
+/// --generate <shape>
+///                Generate a story of the given shape into the directory
+///                given as start file, see generateStory.
+/// --benchmark <n>
+///                Time loading, analyzing, n turns of playing and freeing
+///                the story, see runBenchmark.
+/// --stats        Print phase times and counters to stderr at the end, see
+///                printStatistics.
+///
+/// Sets error to ERR_INVALID_ARGUMENTS, if the arguments are invalid.
+///
+/// @param argc The number of arguments.
+/// @param argv The arguments, as passed to main.
+/// @param arguments A pointer to the Arguments which will be filled.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void parseArguments(int argc, char *argv[], Arguments *arguments, int *error)
+{
+  arguments->run_mode_ = RUN_PLAY;
+  arguments->start_file_ = NULL;
+  arguments->pack_file_ = NULL;
+  arguments->load_flags_ = 0;
+  arguments->load_thread_count_ = 0;
+  arguments->replay_file_ = NULL;
+  arguments->replay_flags_ = 0;
+  arguments->socket_file_ = NULL;
+  arguments->watch_files_ = 0;
+  arguments->lazy_loading_ = 0;
+  arguments->auto_play_ = 0;
+  arguments->compress_text_ = 0;
+  arguments->use_cache_ = 1;
+  arguments->story_shape_ = NULL;
+  arguments->benchmark_turn_count_ = 0;
+  arguments->print_statistics_ = 0;
+
+  for (int index = 1; index < argc; index++)
+  {
+    char *argument = argv[index];
+    if (strcmp(argument, "--mmap") == 0)
+    {
+      arguments->load_flags_ |= LOAD_MAPPED;
+    }
+    else if (strcmp(argument, "--threads") == 0 && index + 1 < argc)
+    {
+      char *number_end = NULL;
+      arguments->load_thread_count_ = strtoul(argv[++index], &number_end, 10);
+      if (*argv[index] == '\0' || *number_end != '\0')
+      {
+        *error = ERR_INVALID_ARGUMENTS;
+        return;
+      }
+    }
+    else if (strcmp(argument, "--replay") == 0 && index + 1 < argc &&
+             !arguments->replay_file_)
+    {
+      arguments->replay_file_ = argv[++index];
+    }
+    else if (strcmp(argument, "--serve") == 0 && index + 1 < argc &&
+             !arguments->socket_file_)
+    {
+      arguments->socket_file_ = argv[++index];
+    }
+    else if (strcmp(argument, "--watch") == 0)
+    {
+      arguments->watch_files_ = 1;
+    }
+    else if (strcmp(argument, "--lazy") == 0)
+    {
+      arguments->lazy_loading_ = 1;
+    }
+    else if (strcmp(argument, "--auto") == 0)
+    {
+      arguments->auto_play_ = 1;
+    }
+    else if (strcmp(argument, "--compress") == 0)
+    {
+      arguments->compress_text_ = 1;
+    }
+    else if (strcmp(argument, "--no-cache") == 0)
+    {
+      arguments->use_cache_ = 0;
+    }
+    else if (strcmp(argument, "--stats") == 0)
+    {
+      arguments->print_statistics_ = 1;
+    }
+    else if (strcmp(argument, "--quiet") == 0)
+    {
+      arguments->replay_flags_ |= REPLAY_QUIET;
+    }
+    else if (strcmp(argument, "--compile") == 0 && !arguments->run_mode_)
+    {
+      arguments->run_mode_ = RUN_COMPILE;
+    }
+    else if (strcmp(argument, "--pack") == 0 && !arguments->run_mode_)
+    {
+      arguments->run_mode_ = RUN_PACK;
+    }
+    else if (strcmp(argument, "--paths") == 0 && !arguments->run_mode_)
+    {
+      arguments->run_mode_ = RUN_PATHS;
+    }
+    else if (strcmp(argument, "--generate") == 0 && index + 1 < argc &&
+             !arguments->run_mode_)
+    {
+      arguments->run_mode_ = RUN_GENERATE;
+      arguments->story_shape_ = argv[++index];
+    }
+    else if (strcmp(argument, "--benchmark") == 0 && index + 1 < argc &&
+             !arguments->run_mode_)
+    {
+      char *number_end = NULL;
+      arguments->run_mode_ = RUN_BENCHMARK;
+      arguments->benchmark_turn_count_ = strtoul(argv[++index], &number_end,
+                                                 10);
+      if (*argv[index] == '\0' || *number_end != '\0')
+      {
+        *error = ERR_INVALID_ARGUMENTS;
+        return;
+      }
+    }
+    else if (strncmp(argument, "--", 2) != 0 && !arguments->start_file_)
+    {
+      arguments->start_file_ = argument;
+    }
+    else if (strncmp(argument, "--", 2) != 0 && !arguments->pack_file_)
+    {
+      arguments->pack_file_ = argument;
+    }
+    else
+    {
+      *error = ERR_INVALID_ARGUMENTS;
+      return;
+    }
+  }
+  if (!arguments->start_file_ ||
+      (arguments->pack_file_ != NULL) !=
+      (arguments->run_mode_ == RUN_COMPILE) ||
+      ((arguments->replay_file_ || arguments->socket_file_) &&
+       arguments->run_mode_ != RUN_PLAY && arguments->run_mode_ != RUN_PACK) ||
+      (arguments->replay_file_ && arguments->socket_file_) ||
+      (arguments->replay_flags_ && !arguments->replay_file_) ||
+      (arguments->watch_files_ &&
+       (!arguments->socket_file_ || arguments->run_mode_ != RUN_PLAY)) ||
+      ((arguments->lazy_loading_ || arguments->auto_play_) &&
+       (arguments->replay_file_ || arguments->socket_file_ ||
+        arguments->run_mode_ != RUN_PLAY)) ||
+      (arguments->lazy_loading_ && arguments->auto_play_) ||
+      (arguments->compress_text_ &&
+       (arguments->socket_file_ || arguments->lazy_loading_ ||
+        arguments->run_mode_ != RUN_PLAY)))
+  {
+    *error = ERR_INVALID_ARGUMENTS;
+  }
+
+  // Watching, lazy loading, the end distances and compressing need the
+  // chapter files to be loaded
+  if (arguments->run_mode_ != RUN_PLAY || arguments->watch_files_ ||
+      arguments->lazy_loading_ || arguments->auto_play_ ||
+      arguments->compress_text_)
+  {
+    arguments->use_cache_ = 0;
+  }
+}
+
 //-----------------------------------------------------------------------------
 ///
 /// Initializes the Game.
-/// Initializing the options_map and start loading the Chapters.
+/// Initializing the options_map and loading all Chapters reachable from the
+/// first one. The Chapters are loaded in depth first order, using a Worklist
+/// instead of recursion.
 ///
 ///
 /// @param filename The filename of the first chapter.
@@ -161,30 +1035,97 @@ void initializeWithFile(char *filename, Map *options_map,
 {
   initializeMap(options_map, error);
   int a = 0b000101010;
-  loadChapterFromFile(filename, options_map, start_chapter, error);
+  StringView start_file = {
+      .start_ = filename,
+      .length_ = strlen(filename)
+  };
+  Worklist worklist = {
+      .length_ = 0,
+      .count_ = 0,
+      .start_option_ = NULL
+  };
+  Prefetcher prefetcher;
+  if (options_map->load_thread_count_)
+  {
+    startPrefetcher(&prefetcher, start_file, options_map, error);
+  }
+  loadChapterFromFile(start_file, options_map, &worklist, start_chapter,
+                      error);
+  if (options_map->lazy_loader_)
+  {
+    publishLazyStart(options_map->lazy_loader_, *start_chapter);
+  }
+  loadPendingOptions(&worklist, options_map, error);
+  free(worklist.start_option_);
+  if (options_map->prefetcher_)
+  {
+    stopPrefetcher(options_map->prefetcher_);
+    options_map->prefetcher_ = NULL;
+  }
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Starts the game with start_chapter.
-/// Prints "ENDE" if the game was successfully finished.
-///
+/// Plays the story starting with start_chapter, either interactively, by
+/// replaying the sessions of the replay file, by serving it on the socket
+/// given in arguments or automatically with --auto.
 ///
-/// @param start_chapter The Chapter with which the game will start.
+/// @param start_chapter The Chapter with which the story starts.
+/// @param map The Map of the story, NULL for packs.
+/// @param arguments The parsed command line arguments.
+/// @param error The error pointer that will be set if an error occurs.
 ///
 /// @return nothing
 //
-void startGame(Chapter *start_chapter)
+void playStory(Chapter *start_chapter, Map *map, Arguments *arguments,
+               int *error)
 {
-  Chapter *next_chapter = start_chapter;
-  do
+  if (arguments->replay_file_)
   {
-    if (playChapter(&next_chapter))
-    {
+    replaySessions(start_chapter, arguments->replay_file_,
+                   arguments->replay_flags_, error);
+  }
+  else if (arguments->socket_file_)
+  {
+    serveStory(start_chapter, arguments->watch_files_ ? map : NULL,
+               arguments->socket_file_, error);
+  }
+  else if (map && arguments->auto_play_)
+  {
+    startAutoGame(&map->graph_);
+  }
+  else if (map)
+  {
+    startGraphGame(&map->graph_);
+  }
+  else
+  {
+    startGame(start_chapter, NULL);
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Starts the game with start_chapter.
+/// The frame of the last Chapter prints "ENDE" if the game was successfully
+/// finished.
+///
+///
+/// @param start_chapter The Chapter with which the game will start.
+/// @param lazy_loader The LazyLoader that still loads the story or NULL.
+///
+/// @return nothing
+//
+void startGame(Chapter *start_chapter, LazyLoader *lazy_loader)
+{
+  Chapter *next_chapter = start_chapter;
+  do
+  {
+    if (playChapter(&next_chapter, lazy_loader))
+    {
       return;
     }
   } while (next_chapter);
-  printf("ENDE\n");
 }
 
 //-----------------------------------------------------------------------------
@@ -194,37 +1135,202 @@ void startGame(Chapter *start_chapter)
 /// updated to reference to the new chapter.
 ///
 /// If an EOF was read as user inupt, EOF will be returned.
+/// While the story is loaded lazily, the options are taken from lazy_loader.
+/// A Chapter without pre-rendered frame waits for its first option, as its
+/// prompt depends on it.
 ///
 /// @param chapter A reference to the pointer of a chapter.
+/// @param lazy_loader The LazyLoader that still loads the story or NULL.
 ///
-/// @return 0 or EOF if an EOF occured.
+/// @return 0 or EOF if an EOF occured or the story could not be loaded.
 //
-int playChapter(Chapter **chapter)
+int playChapter(Chapter **chapter, LazyLoader *lazy_loader)
 {
-  printf("------------------------------\n");
-  printf("%s\n\n%s\n\n", (*chapter)->title_, (*chapter)->text_);
-  if ((*chapter)->options_[0] == NULL)
+  if (lazy_loader && !(*chapter)->frame_ &&
+      !waitForLazyOption(lazy_loader, *chapter, 0) &&
+      !isLazyEnd(lazy_loader, *chapter))
+  {
+    // The first option could not be loaded
+    return EOF;
+  }
+  writeChapterFrame(*chapter);
+  int is_end = lazy_loader ? isLazyEnd(lazy_loader, *chapter)
+                           : (*chapter)->options_[0] == NULL;
+  if (is_end)
   {
     *chapter = NULL;
     return 0;
   }
 
-  printf("Deine Wahl (A/B)? ");
-  do
+  int choice = readValidChoice();
+  if (choice == EOF)
+  {
+    return EOF;
+  }
+  *chapter = lazy_loader ? waitForLazyOption(lazy_loader, *chapter, choice)
+                         : (*chapter)->options_[choice];
+  return *chapter ? 0 : EOF;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Starts the game with node 0 of graph, like startGame but the options are
+/// followed in the StoryGraph.
+///
+/// @param graph The analyzed StoryGraph of the story.
+///
+/// @return nothing
+//
+void startGraphGame(StoryGraph *graph)
+{
+  uint32_t node = 0;
+  while (1)
   {
-    int choice = getChoice();
-    if (choice < 0)
+    writeChapterFrame(graph->chapters_[node]);
+    uint32_t first_edge = graph->edge_starts_[node];
+    if (first_edge == graph->edge_starts_[node + 1])
     {
-      if (choice == EOF)
-      {
-        return EOF;
-      }
-      printf("[ERR] Please enter A or B.\n");
-      continue;
+      return;
     }
-    *chapter = (*chapter)->options_[choice];
-    return 0;
-  } while (1);
+    int choice = readValidChoice();
+    if (choice == EOF)
+    {
+      return;
+    }
+    node = graph->edges_[first_edge + choice];
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Plays the story of graph without reading choices. Every turn takes the
+/// option with the fewest choices to an end, which is looked up in the
+/// distances of computeEndDistances, and prints it after the prompt. The
+/// game stops at an end or at a node which can't reach an end.
+///
+/// @param graph The analyzed StoryGraph of the story.
+///
+/// @return nothing
+//
+void startAutoGame(StoryGraph *graph)
+{
+  uint32_t node = 0;
+  while (1)
+  {
+    writeChapterFrame(graph->chapters_[node]);
+    uint32_t first_edge = graph->edge_starts_[node];
+    if (first_edge == graph->edge_starts_[node + 1] ||
+        graph->end_distances_[node] == NO_END_DISTANCE)
+    {
+      return;
+    }
+    int choice = graph->best_options_[node];
+    printf("%c\n", 'A' + choice);
+    node = graph->edges_[first_edge + choice];
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Renders the complete output of chapter into a single buffer: the
+/// separator, title, text and either the prompt or "ENDE" for end chapters.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param arena The Arena which will own the frame.
+/// @param chapter The Chapter whose frame should be rendered.
+/// @param is_end_chapter If chapter is an end of the story.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void renderChapterFrame(Arena *arena, Chapter *chapter, int is_end_chapter,
+                        int *error)
+{
+  if (*error)
+  {
+    return;
+  }
+
+  char *ending = is_end_chapter ? FRAME_END : FRAME_PROMPT;
+  size_t ending_length = strlen(ending);
+  size_t frame_length = strlen(FRAME_SEPARATOR) + chapter->title_length_ + 2 +
+                        chapter->text_length_ + 2 + ending_length;
+  char *frame = (char *) allocateFromArena(arena, frame_length, error);
+  if (frame == NULL)
+  {
+    return;
+  }
+
+  char *position = frame;
+  memcpy(position, FRAME_SEPARATOR, strlen(FRAME_SEPARATOR));
+  position += strlen(FRAME_SEPARATOR);
+  memcpy(position, chapter->title_, chapter->title_length_);
+  position += chapter->title_length_;
+  memcpy(position, "\n\n", 2);
+  position += 2;
+  memcpy(position, chapter->text_, chapter->text_length_);
+  position += chapter->text_length_;
+  memcpy(position, "\n\n", 2);
+  position += 2;
+  memcpy(position, ending, ending_length);
+
+  chapter->frame_ = frame;
+  chapter->frame_length_ = frame_length;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Prints the output of chapter to stdout, with a single write if its frame
+/// was rendered. A compressed frame is decompressed first.
+///
+/// @param chapter The Chapter that should be printed.
+///
+/// @return nothing
+//
+void writeChapterFrame(Chapter *chapter)
+{
+  if (chapter->text_block_)
+  {
+    char *block_text = getTextBlock(chapter->text_block_);
+    if (block_text)
+    {
+      fwrite(block_text + chapter->frame_offset_, 1, chapter->frame_length_,
+             stdout);
+    }
+    return;
+  }
+  if (chapter->frame_)
+  {
+    fwrite(chapter->frame_, 1, chapter->frame_length_, stdout);
+    return;
+  }
+
+  printf(FRAME_SEPARATOR);
+  printf("%.*s\n\n%.*s\n\n", (int) chapter->title_length_, chapter->title_,
+         (int) chapter->text_length_, chapter->text_);
+  printf("%s", chapter->options_[0] ? FRAME_PROMPT : FRAME_END);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Returns the title of chapter, which is taken from its decompressed frame
+/// if it was compressed.
+///
+/// @param chapter The Chapter whose title is needed.
+///
+/// @return The title, which is title_length_ bytes long, or "" if the frame
+/// can't be decompressed.
+//
+char *getChapterTitle(Chapter *chapter)
+{
+  if (chapter->text_block_)
+  {
+    char *block_text = getTextBlock(chapter->text_block_);
+    return block_text ? block_text + chapter->frame_offset_ +
+                        strlen(FRAME_SEPARATOR) : "";
+  }
+  return chapter->title_;
 }
 
 //-----------------------------------------------------------------------------
@@ -237,11 +1343,7 @@ int playChapter(Chapter **chapter)
 //
 int getChoice()
 {
-  enum _State_
-  {
-    S_INVALID = -3, S_BEGIN = -2, S_CHOICE_A = 0, S_CHOICE_B = 1
-  } state;
-  state = S_BEGIN;
+  ChoiceState state = CHOICE_BEGIN;
 
   while (1)
   {
@@ -254,1029 +1356,6768 @@ int getChoice()
     {
       return state;
     }
-    if (state == S_BEGIN)
-    {
-      switch (input_character)
-      {
-        case 'A':
-          state = S_CHOICE_A;
-          break;
-        case 'B':
-          state = S_CHOICE_B;
-          break;
-        default:
-          state = S_INVALID;
-      }
-    }
-    else
-    {
-      state = S_INVALID;
-    }
+    state = readChoiceCharacter(state, input_character);
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Reads choices with getChoice until a valid one is entered. An error
+/// message is printed for every invalid choice.
+///
+/// @return 0 for A, 1 for B or EOF if an EOF occured.
+//
+int readValidChoice()
+{
+  int choice = getChoice();
+  while (choice < 0 && choice != EOF)
+  {
+    printf(FRAME_INVALID_CHOICE);
+    choice = getChoice();
+  }
+  return choice;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Advances the state of reading a choice line by one character, which is
+/// not the end of the line.
+///
+/// @param state The state before the character.
+/// @param input_character The read character.
+///
+/// @return The state after the character.
+//
+ChoiceState readChoiceCharacter(ChoiceState state, int input_character)
+{
+  if (state != CHOICE_BEGIN)
+  {
+    return CHOICE_INVALID;
+  }
+  switch (input_character)
+  {
+    case 'A':
+      return CHOICE_A;
+    case 'B':
+      return CHOICE_B;
+    default:
+      return CHOICE_INVALID;
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Describes the output of chapter as pieces, which can be written with a
+/// single writev. A rendered frame is a single piece.
+///
+/// @param chapter The Chapter whose output is needed.
+/// @param pieces An array of at least 6 pieces which will be filled.
+///
+/// @return The number of pieces.
+//
+int getChapterFramePieces(Chapter *chapter, struct iovec *pieces)
+{
+  if (chapter->frame_)
+  {
+    pieces[0] = (struct iovec) {chapter->frame_, chapter->frame_length_};
+    return 1;
   }
+
+  char *ending = chapter->options_[0] ? FRAME_PROMPT : FRAME_END;
+  pieces[0] = (struct iovec) {FRAME_SEPARATOR, strlen(FRAME_SEPARATOR)};
+  pieces[1] = (struct iovec) {chapter->title_, chapter->title_length_};
+  pieces[2] = (struct iovec) {"\n\n", 2};
+  pieces[3] = (struct iovec) {chapter->text_, chapter->text_length_};
+  pieces[4] = (struct iovec) {"\n\n", 2};
+  pieces[5] = (struct iovec) {ending, strlen(ending)};
+  return 6;
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Loads a Chapter and all SubChapter/Options  from a file and puts them into
-/// the options map.
+/// Loads a Chapter from a file and puts it into the options map. If the
+/// Chapter is no duplicate, its options are pushed onto the worklist. Files
+/// which are already loaded through another path are not read again.
 ///
 ///
 /// @param filename The file from which the Chapter should be loaded.
 /// @param options_map The Map into which all Chapter will be put.
-/// @param chapter A reference to the pointer of the first Chapter. Will be set
+/// @param worklist The Worklist onto which the options will be pushed.
+/// @param chapter A reference to the pointer of the Chapter. Will be set
 /// in the method.
 /// @param error The error pointer that will be set if an error occurs.
 ///
 /// @return nothing
 //
-void loadChapterFromFile(char *filename, Map *options_map, Chapter **chapter,
-                         int *error)
+void loadChapterFromFile(StringView filename, Map *options_map,
+                         Worklist *worklist, Chapter **chapter, int *error)
 {
   if (*error)
   {
     return;
   }
 
-  char *raw_chapter = NULL;
-  loadChapterText(filename, &raw_chapter, error);
-  createChapter(chapter, error);
-  char *title = NULL;
-  char *text = NULL;
-  char *option_files[OPTION_COUNT];
-  getChapterPropertiesFromText(raw_chapter, &title, &text, option_files, error);
+  char *path = NULL;
+  copyStringView(filename, &path, error);
+
+  // Another path to an already loaded file only needs a new entry
+  FileIdentity file_identity = {0};
+  if (!*error)
+  {
+    file_identity = getFileIdentity(path);
+  }
+  Chapter *loaded_chapter = getChapterFromFileIdentity(options_map,
+                                                       file_identity);
+  if (loaded_chapter)
+  {
+    countStatistic(&statistics.identity_hits_, 1);
+    free(path);
+    *chapter = insertChapterIntoMap(options_map, filename, file_identity,
+                                    loaded_chapter, error);
+    return;
+  }
 
+  char *content = NULL;
+  size_t content_length = 0;
+  int is_mapped = 0;
+  unsigned long long content_hash = 0;
+  if (options_map->prefetcher_)
+  {
+    takePrefetchedText(options_map->prefetcher_, filename, &content,
+                       &content_length, &is_mapped, &content_hash, error);
+  }
+  else
+  {
+    loadChapterText(path, options_map->load_flags_, &options_map->text_arena_,
+                    &content, &content_length, &is_mapped, error);
+  }
+  createChapter(&options_map->chapter_arena_, chapter, error);
   if (*chapter)
   {
-    (*chapter)->title_ = title;
-    (*chapter)->text_ = text;
+    (*chapter)->content_ = content;
+    (*chapter)->content_length_ = content_length;
+    (*chapter)->is_mapped_ = is_mapped;
+  }
+  // The hash is computed while parsing, unless a prefetch thread did it
+  StringView title;
+  StringView text;
+  StringView option_files[OPTION_COUNT];
+  getChapterPropertiesFromText(content, content_length, &title, &text,
+                               option_files,
+                               options_map->prefetcher_ ? NULL : &content_hash,
+                               error);
+
+  if (*chapter && !*error)
+  {
+    (*chapter)->content_hash_ = content_hash;
+    (*chapter)->title_ = title.start_;
+    (*chapter)->title_length_ = title.length_;
+    (*chapter)->text_ = text.start_;
+    (*chapter)->text_length_ = text.length_;
   }
 
   validateOptions(option_files, error);
   if (*error == ERR_IO)
   {
-    freeChapter(*chapter);
-    printError(*error, filename);
-    if (filename)
-    {
-      free(filename);
-    }
+    freeChapter(options_map, *chapter);
+    *chapter = NULL;
+    printError(*error, path);
+    free(path);
     return;
   }
+  free(path);
 
 
   Chapter *chapter_in_map = insertChapterIntoMap(options_map, filename,
-                                                 *chapter, error);
+                                                 file_identity, *chapter,
+                                                 error);
   // If an duplicate is found we free the Chapter and we do not have
   // to assign the options again, as they are already set.
   if (chapter_in_map != *chapter)
   {
-    freeChapter(*chapter);
+    freeChapter(options_map, *chapter);
     *chapter = chapter_in_map;
   }
   else
   {
-    loadAndAssignOptions(*chapter, option_files, options_map, error);
+    if (!(options_map->load_flags_ & LOAD_MAPPED))
+    {
+      renderChapterFrame(&options_map->text_arena_, *chapter,
+                         isEndOption(option_files[0]), error);
+    }
+    queueOptions(*chapter, option_files, worklist, error);
   }
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Loads the files/chapter of option_files if needed, and assignes the pointer
-/// of the subchapter to chapter.
+/// Assignes the end options of chapter and pushes all other options onto the
+/// worklist. They are pushed in reverse order, so the first option is loaded
+/// first.
 ///
 ///
 /// @param chapter A pointer to the Chapter on which the options should be set.
 /// @param option_files The options that should be loaded. The options must be
 /// validated already.
-/// @param options_map The Map containing all already loaded Chapter.
+/// @param worklist The Worklist onto which the options will be pushed.
 /// @param error The error pointer that will be set if an error occurs.
 ///
 /// @return nothing
 //
-void loadAndAssignOptions(Chapter *chapter, char *option_files[OPTION_COUNT],
-                          Map *options_map, int *error)
+void queueOptions(Chapter *chapter, StringView option_files[OPTION_COUNT],
+                  Worklist *worklist, int *error)
 {
-  for (int option_index = 0;
-       option_index < OPTION_COUNT && !*error;
-       option_index++)
+  for (int option_index = OPTION_COUNT - 1;
+       option_index >= 0 && !*error;
+       option_index--)
   {
+    chapter->options_[option_index] = NULL;
     if (isEndOption(option_files[option_index]))
     {
-      chapter->options_[option_index] = NULL;
       continue;
     }
 
-    Chapter *subchapter = getChapterFromMap(options_map,
-                                            option_files[option_index]);
-    if (subchapter == NULL)
-    {
-      loadChapterFromFile(option_files[option_index], options_map, &subchapter,
-                          error);
-    }
-    chapter->options_[option_index] = subchapter;
+    PendingOption option = {
+        .chapter_ = chapter,
+        .option_index_ = option_index,
+        .filename_ = option_files[option_index]
+    };
+    pushPendingOption(worklist, option, error);
+    chapter->pending_option_count_++;
   }
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Allocates memory for a Chapter.
+/// Pushes option onto the worklist. If the worklist has not enough space, its
+/// size will be doubled.
 ///
 /// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
 ///
-/// @param chapter The reference to a pointer on which the memory will be
-/// accessible. Or NULL if an error occurs.
+/// @param worklist The Worklist onto which option will be pushed.
+/// @param option The PendingOption that should be pushed.
 /// @param error The error pointer that will be set if an error occurs.
 ///
 /// @return nothing
 //
-void createChapter(Chapter **chapter, int *error)
+void pushPendingOption(Worklist *worklist, PendingOption option, int *error)
 {
   if (*error)
   {
     return;
   }
-
-  *chapter = (Chapter *) malloc(sizeof(Chapter));
-  if (*chapter == NULL)
+  if (worklist->count_ >= worklist->length_)
   {
-    *error = ERR_OUT_OF_MEMORY;
-    return;
+    size_t length = worklist->length_ ? worklist->length_ * 2
+                                      : WORKLIST_MALLOC_INTERVALL;
+    PendingOption *temporary_options = (PendingOption *) realloc(
+        worklist->start_option_, length * sizeof(PendingOption));
+    if (temporary_options == NULL)
+    {
+      *error = ERR_OUT_OF_MEMORY;
+      return;
+    }
+    worklist->start_option_ = temporary_options;
+    worklist->length_ = length;
   }
+  worklist->start_option_[worklist->count_++] = option;
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Extracts the properties pointer of raw_chapter and replaces '\n' with null
-/// terminators, so the pointers are limited.
+/// Pops the options from the worklist until it is empty, loads their Chapters
+/// if needed, and assignes the pointer of the subchapter to the Chapter of the
+/// option. The options of newly loaded Chapters are pushed onto the worklist,
+/// so the Chapters are loaded in the same order as a depth first recursion
+/// would load them.
 ///
-/// @param raw_chapter The raw chapter text, as from a file.
-/// @param title A reference to the pointer of the title. Will be overwritten.
-/// @param text A reference to the pointer of the text. Will be overwritten.
-/// @param options An array that will be filled with the options that are
-/// extracted.
+///
+/// @param worklist The Worklist containing the pending options.
+/// @param options_map The Map containing all already loaded Chapter.
 /// @param error The error pointer that will be set if an error occurs.
 ///
 /// @return nothing
 //
-void getChapterPropertiesFromText(char *raw_chapter, char **title, char **text,
-                                  char *options[OPTION_COUNT], int *error)
+void loadPendingOptions(Worklist *worklist, Map *options_map, int *error)
 {
-  if (*error)
-  {
-    return;
-  }
-
-  *title = raw_chapter;
-
-  char *next_field = raw_chapter;
-  findAndReplaceNewLine(&next_field, error);
-  for (int option_index = 0;
-       option_index < OPTION_COUNT && !*error;
-       option_index++)
+  while (worklist->count_ && !*error)
   {
-    (options)[option_index] = next_field;
-    findAndReplaceNewLine(&next_field, error);
+    PendingOption option = worklist->start_option_[--worklist->count_];
+    Chapter *subchapter = getChapterFromMap(options_map, option.filename_);
+    if (subchapter == NULL)
+    {
+      loadChapterFromFile(option.filename_, options_map, worklist, &subchapter,
+                          error);
+    }
+    if (options_map->lazy_loader_)
+    {
+      publishLazyOption(options_map->lazy_loader_, option, subchapter);
+    }
+    else
+    {
+      option.chapter_->options_[option.option_index_] = subchapter;
+      option.chapter_->pending_option_count_--;
+    }
   }
-  *text = next_field;
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Validates the options in the options array.
-/// If the options are not valid, error will be set to ERR_IO.
+/// Starts load_thread_count_ threads of options_map, which read the chapter
+/// files reachable from start_file in advance. The loader takes the read
+/// files in its own order with takePrefetchedText, so the loaded story and
+/// the reported errors are the same as without threads.
+/// If no thread or lock can be created, the loader reads all files itself.
 ///
-/// @param options An array containing options.
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param prefetcher The Prefetcher that should be started.
+/// @param start_file The first chapter file, which is queued.
+/// @param options_map The Map whose loader will use the Prefetcher.
 /// @param error The error pointer that will be set if an error occurs.
 ///
 /// @return nothing
 //
-void validateOptions(char *options[OPTION_COUNT], int *error)
+void startPrefetcher(Prefetcher *prefetcher, StringView start_file,
+                     Map *options_map, int *error)
 {
   if (*error)
   {
     return;
   }
 
-  // Checking first option for validity
-  if (!isOptionValid(options[0]))
+  prefetcher->stop_ = 0;
+  prefetcher->load_flags_ = options_map->load_flags_;
+  prefetcher->entry_count_ = 0;
+  prefetcher->slot_count_ = PREFETCH_MALLOC_INTERVALL;
+  prefetcher->slots_ = (PrefetchEntry **) calloc(prefetcher->slot_count_,
+                                                 sizeof(PrefetchEntry *));
+  prefetcher->first_queued_ = NULL;
+  prefetcher->last_queued_ = NULL;
+  prefetcher->thread_count_ = 0;
+  prefetcher->loader_arena_ = &options_map->text_arena_;
+  prefetcher->threads_ = (PrefetchThread *) malloc(
+      options_map->load_thread_count_ * sizeof(PrefetchThread));
+  if (prefetcher->slots_ == NULL || prefetcher->threads_ == NULL)
   {
-    *error = ERR_IO;
+    free(prefetcher->slots_);
+    free(prefetcher->threads_);
+    *error = ERR_OUT_OF_MEMORY;
     return;
   }
-  int is_end_chapter = isEndOption(options[0]);
+  int has_lock = mtx_init(&prefetcher->lock_, mtx_plain) == thrd_success;
+  int has_work_available = cnd_init(&prefetcher->work_available_) ==
+                           thrd_success;
+  int has_work_done = cnd_init(&prefetcher->work_done_) == thrd_success;
+  if (!has_lock || !has_work_available || !has_work_done)
+  {
+    if (has_work_done)
+    {
+      cnd_destroy(&prefetcher->work_done_);
+    }
+    if (has_work_available)
+    {
+      cnd_destroy(&prefetcher->work_available_);
+    }
+    if (has_lock)
+    {
+      mtx_destroy(&prefetcher->lock_);
+    }
+    free(prefetcher->slots_);
+    free(prefetcher->threads_);
+    return;
+  }
+  getPrefetchEntry(prefetcher, start_file, error);
+  options_map->prefetcher_ = prefetcher;
 
-  // Check remaining options for validity
-  for (int option_index = 1; option_index < OPTION_COUNT; option_index++)
+  while (prefetcher->thread_count_ < options_map->load_thread_count_)
   {
-    if (!isOptionValid(options[option_index]) ||
-        isEndOption(options[option_index]) != is_end_chapter)
+    PrefetchThread *thread = prefetcher->threads_ + prefetcher->thread_count_;
+    thread->prefetcher_ = prefetcher;
+    thread->arena_.current_block_ = NULL;
+    if (thrd_create(&thread->thread_, runPrefetchThread, thread) !=
+        thrd_success)
     {
-      *error = ERR_IO;
-      return;
+      break;
     }
+    prefetcher->thread_count_++;
   }
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Returns if option represents a valid option. E.g. if the option is not
-/// empty.
+/// Stops and joins the threads of prefetcher and frees all entries. The Arenas
+/// of the threads are handed to the loader, files which were read but never
+/// taken by the loader are unmapped.
 ///
-/// @param option The option that should be checked.
+/// @param prefetcher The Prefetcher that should be stopped.
 ///
-/// @return If option represents a valid option. E.g. if the option is not
-/// empty.
+/// @return nothing
 //
-int isOptionValid(char *option)
+void stopPrefetcher(Prefetcher *prefetcher)
 {
-  return strlen(option) > 0;
+  mtx_lock(&prefetcher->lock_);
+  prefetcher->stop_ = 1;
+  cnd_broadcast(&prefetcher->work_available_);
+  mtx_unlock(&prefetcher->lock_);
+  for (size_t index = 0; index < prefetcher->thread_count_; index++)
+  {
+    thrd_join(prefetcher->threads_[index].thread_, NULL);
+    mergeArena(prefetcher->loader_arena_, &prefetcher->threads_[index].arena_);
+  }
+
+  for (size_t slot = 0; slot < prefetcher->slot_count_; slot++)
+  {
+    PrefetchEntry *entry = prefetcher->slots_[slot];
+    if (entry == NULL)
+    {
+      continue;
+    }
+    if (entry->state_ == PREFETCH_DONE && entry->content_)
+    {
+      Chapter unused_chapter = {
+          .content_ = entry->content_,
+          .content_length_ = entry->content_length_,
+          .is_mapped_ = entry->is_mapped_
+      };
+      freeChapterContent(&unused_chapter);
+    }
+    free(entry->path_);
+    free(entry);
+  }
+  free(prefetcher->slots_);
+  free(prefetcher->threads_);
+  cnd_destroy(&prefetcher->work_done_);
+  cnd_destroy(&prefetcher->work_available_);
+  mtx_destroy(&prefetcher->lock_);
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Returns if option represents an "End option" e.g. if it is equal to "-".
+/// The main function of a prefetch thread. Reads queued files until the
+/// Prefetcher is stopped.
 ///
-/// @param option The option that should be checked.
+/// @param argument A pointer to the PrefetchThread.
 ///
-/// @return If option represents an "End option" e.g. if it is equal to "-".
+/// @return 0
 //
-int isEndOption(char *option)
+int runPrefetchThread(void *argument)
 {
-  return strlen(option) == 1 && option[0] == '-';
+  PrefetchThread *thread = (PrefetchThread *) argument;
+  Prefetcher *prefetcher = thread->prefetcher_;
+  mtx_lock(&prefetcher->lock_);
+  while (!prefetcher->stop_)
+  {
+    PrefetchEntry *entry = prefetcher->first_queued_;
+    if (entry == NULL)
+    {
+      cnd_wait(&prefetcher->work_available_, &prefetcher->lock_);
+      continue;
+    }
+    prefetcher->first_queued_ = entry->next_queued_;
+    if (entry->state_ != PREFETCH_QUEUED)
+    {
+      // The loader already took the file from the queue
+      continue;
+    }
+    entry->state_ = PREFETCH_LOADING;
+    mtx_unlock(&prefetcher->lock_);
+    loadPrefetchEntry(prefetcher, entry, &thread->arena_);
+    mtx_lock(&prefetcher->lock_);
+  }
+  mtx_unlock(&prefetcher->lock_);
+  return 0;
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Initializes a Map, with a default length of MAP_MALLOC_INTERVALL
+/// Returns the entry of filename and creates and queues it, if it does not
+/// exist yet. The lock of prefetcher must be held.
 ///
-/// @param map A pointer to the map, that will be initialized.
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param prefetcher The Prefetcher containing the entries.
+/// @param filename The path of the chapter file.
 /// @param error The error pointer that will be set if an error occurs.
 ///
-/// @return nothing
+/// @return The entry of filename or NULL if an error occurred.
 //
-void initializeMap(Map *map, int *error)
+PrefetchEntry *getPrefetchEntry(Prefetcher *prefetcher, StringView filename,
+                                int *error)
 {
-  MapEntry *map_entry;
-  size_t size = createMapEntryArray(&map_entry, MAP_MALLOC_INTERVALL, error);
-  map->start_entry_ = map_entry;
-  map->length_ = size;
-}
+  size_t path_hash = hashFilename(filename);
+  size_t mask = prefetcher->slot_count_ - 1;
+  size_t slot = path_hash & mask;
+  for (; prefetcher->slots_[slot]; slot = (slot + 1) & mask)
+  {
+    PrefetchEntry *entry = prefetcher->slots_[slot];
+    if (entry->path_hash_ == path_hash &&
+        entry->path_length_ == filename.length_ &&
+        memcmp(entry->path_, filename.start_, filename.length_) == 0)
+    {
+      return entry;
+    }
+  }
 
-//-----------------------------------------------------------------------------
-///
-/// Searches for an entry in the map with the key in filename.
-///
-///
-/// @param map The map, from which the chapter should be received.
-/// @param filename The filename for the Chapter e.g. The key in the map.
-///
-/// @return A pointer to the Chapter or null, if no entry was found.
-//
-Chapter *getChapterFromMap(Map *map, char *filename)
-{
-  for (MapEntry *entry = map->start_entry_;
-       entry < map->start_entry_ +
-               map->count_; entry++)
+  PrefetchEntry *entry = (PrefetchEntry *) calloc(1, sizeof(PrefetchEntry));
+  if (entry == NULL)
+  {
+    *error = ERR_OUT_OF_MEMORY;
+    return NULL;
+  }
+  copyStringView(filename, &entry->path_, error);
+  if (*error)
+  {
+    free(entry);
+    return NULL;
+  }
+  entry->path_length_ = filename.length_;
+  entry->path_hash_ = path_hash;
+  entry->state_ = PREFETCH_QUEUED;
+  prefetcher->slots_[slot] = entry;
+  prefetcher->entry_count_++;
+
+  if (prefetcher->first_queued_)
+  {
+    prefetcher->last_queued_->next_queued_ = entry;
+  }
+  else
+  {
+    prefetcher->first_queued_ = entry;
+  }
+  prefetcher->last_queued_ = entry;
+  cnd_signal(&prefetcher->work_available_);
+
+  if (prefetcher->entry_count_ * 100 >
+      prefetcher->slot_count_ * MAP_MAX_LOAD_PERCENT)
   {
-    if (strcmp(entry->key_, filename) == 0)
+    // Grow the index, the entries themselves stay in place
+    size_t slot_count = prefetcher->slot_count_ * 2;
+    PrefetchEntry **slots = (PrefetchEntry **) calloc(slot_count,
+                                                      sizeof(PrefetchEntry *));
+    if (slots == NULL)
     {
-      return entry->value_;
+      *error = ERR_OUT_OF_MEMORY;
+      return entry;
+    }
+    for (size_t old_slot = 0; old_slot < prefetcher->slot_count_; old_slot++)
+    {
+      PrefetchEntry *old_entry = prefetcher->slots_[old_slot];
+      if (old_entry == NULL)
+      {
+        continue;
+      }
+      size_t new_slot = old_entry->path_hash_ & (slot_count - 1);
+      while (slots[new_slot])
+      {
+        new_slot = (new_slot + 1) & (slot_count - 1);
+      }
+      slots[new_slot] = old_entry;
     }
+    free(prefetcher->slots_);
+    prefetcher->slots_ = slots;
+    prefetcher->slot_count_ = slot_count;
   }
-  return NULL;
+  return entry;
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Returns an equal Chapter from map if one exists, else NULL.
+/// Reads the file of entry, which must be in the state PREFETCH_LOADING, and
+/// queues the options found in it. Afterwards the entry is PREFETCH_DONE.
+/// The lock of prefetcher must not be held.
 ///
-/// @param map The Map in which a equal Chapter should be searched.
-/// @param chapter The Chapter for which an equal Chapter should be found.
+/// @param prefetcher The Prefetcher containing entry.
+/// @param entry The entry whose file should be read.
+/// @param arena The Arena of the calling thread, which will own the content.
 ///
-/// @return An equal Chapter from map if one exists, else NULL.
+/// @return nothing
 //
-Chapter *getEqualChapter(Map *map, Chapter *chapter)
+void loadPrefetchEntry(Prefetcher *prefetcher, PrefetchEntry *entry,
+                       Arena *arena)
 {
-  for (MapEntry *entry = map->start_entry_;
-       entry < map->start_entry_ + map->count_;
-       entry++)
+  int error = 0;
+  loadChapterText(entry->path_, prefetcher->load_flags_, arena,
+                  &entry->content_, &entry->content_length_,
+                  &entry->is_mapped_, &error);
+  StringView title;
+  StringView text;
+  StringView option_files[OPTION_COUNT];
+  if (!error)
   {
-    if (areEqual(entry->value_, chapter))
+    // Parse errors are reported by the loader, they only stop the discovery
+    int parse_error = 0;
+    getChapterPropertiesFromText(entry->content_, entry->content_length_,
+                                 &title, &text, option_files,
+                                 &entry->content_hash_, &parse_error);
+    validateOptions(option_files, &parse_error);
+    if (parse_error || isEndOption(option_files[0]))
     {
-      return entry->value_;
+      option_files[0].length_ = 0;
+      option_files[1].length_ = 0;
     }
   }
-  return NULL;
+  else
+  {
+    entry->content_ = NULL;
+  }
+
+  mtx_lock(&prefetcher->lock_);
+  entry->error_ = error;
+  entry->state_ = PREFETCH_DONE;
+  for (int option_index = 0;
+       option_index < OPTION_COUNT && !error;
+       option_index++)
+  {
+    if (option_files[option_index].length_)
+    {
+      // Queuing is only a hint, the loader queues missing files itself
+      int queue_error = 0;
+      getPrefetchEntry(prefetcher, option_files[option_index], &queue_error);
+    }
+  }
+  cnd_broadcast(&prefetcher->work_done_);
+  mtx_unlock(&prefetcher->lock_);
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Inserts the chapter into the map. If the map has not enough space, it will
-/// be resized.
+/// Hands the content of the chapter file filename to the loader. If the file
+/// is still queued, it is read on the calling thread, if it is read by a
+/// prefetch thread, the call waits for it.
 ///
-/// @param map A pointer to the map, in which chapter will be inserted.
-/// @param filename The filename e.g. The key in the map.
-/// @param chapter A pointer to the chapter, that will be inserted.
+/// The error will be set to the error of loadChapterText or to
+/// ERR_OUT_OF_MEMORY.
+///
+/// @param prefetcher The Prefetcher reading the files.
+/// @param filename The path of the chapter file.
+/// @param text The reference to the pointer on which the text will be
+/// accessible.
+/// @param length A pointer to the size_t, which will be set to the length of
+/// the text.
+/// @param is_mapped A pointer to the int, which will be set to 1 if text is a
+/// mapping of the file.
+/// @param content_hash A pointer which will be set to the hash of the text.
 /// @param error The error pointer that will be set if an error occurs.
 ///
-/// @return A pointer to the saved Chapter.
+/// @return nothing
 //
-Chapter *insertChapterIntoMap(Map *map, char *filename, Chapter *chapter,
-                              int *error)
+void takePrefetchedText(Prefetcher *prefetcher, StringView filename,
+                        char **text, size_t *length, int *is_mapped,
+                        unsigned long long *content_hash, int *error)
 {
   if (*error)
   {
-    return NULL;
+    return;
   }
-  if (map->count_ >= map->length_)
+
+  mtx_lock(&prefetcher->lock_);
+  PrefetchEntry *entry = getPrefetchEntry(prefetcher, filename, error);
+  if (entry == NULL)
   {
-    if (resizeMap(map, MAP_MALLOC_INTERVALL, error) == 0)
-    {
-      return NULL;
-    }
+    mtx_unlock(&prefetcher->lock_);
+    return;
   }
-  Chapter *duplicate_chapter = getEqualChapter(map, chapter);
-
-  MapEntry *new_entry = (map->start_entry_ + map->count_);
-  map->count_++;
-
-  new_entry->key_ = filename;
-  if (duplicate_chapter)
+  if (entry->state_ == PREFETCH_QUEUED)
   {
-    new_entry->value_ = duplicate_chapter;
+    // Don't wait for a thread, the queue stays valid as threads skip it
+    entry->state_ = PREFETCH_LOADING;
+    mtx_unlock(&prefetcher->lock_);
+    loadPrefetchEntry(prefetcher, entry, prefetcher->loader_arena_);
+    mtx_lock(&prefetcher->lock_);
   }
-  else
+  while (entry->state_ == PREFETCH_LOADING)
   {
-    new_entry->value_ = chapter;
+    cnd_wait(&prefetcher->work_done_, &prefetcher->lock_);
   }
-  return new_entry->value_;
+
+  if (entry->state_ == PREFETCH_TAKEN)
+  {
+    // Only happens for a path loaded twice, e.g. after an error
+    mtx_unlock(&prefetcher->lock_);
+    loadChapterText(entry->path_, prefetcher->load_flags_,
+                    prefetcher->loader_arena_, text, length, is_mapped, error);
+    if (!*error)
+    {
+      *content_hash = hashContent(*text, *length);
+    }
+    return;
+  }
+  entry->state_ = PREFETCH_TAKEN;
+  *error = entry->error_;
+  *text = entry->content_;
+  *length = entry->content_length_;
+  *is_mapped = entry->is_mapped_;
+  *content_hash = entry->content_hash_;
+  entry->content_ = NULL;
+  mtx_unlock(&prefetcher->lock_);
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Returns the smaller of the two inputs.
+/// Allocates memory for a Chapter from arena.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
 ///
-/// @param first The first size_t to compare.
-/// @param second The second size_t to compare.
+/// @param arena The Arena which will own the Chapter.
+/// @param chapter The reference to a pointer on which the memory will be
+/// accessible. Or NULL if an error occurs.
+/// @param error The error pointer that will be set if an error occurs.
 ///
-/// @return The smaller of the two size_t parameters.
+/// @return nothing
 //
-size_t min(size_t first, size_t second)
+void createChapter(Arena *arena, Chapter **chapter, int *error)
 {
-  return first < second ? first : second;
+  if (*error)
+  {
+    return;
+  }
+
+  *chapter = (Chapter *) allocateFromArena(arena, sizeof(Chapter), error);
+  if (*chapter == NULL)
+  {
+    return;
+  }
+  memset(*chapter, 0, sizeof(Chapter));
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Checks if the two given Chapter are equal.
-/// Equal is defined with having the same memory content/file content.
+/// Extracts the properties of the content of a chapter file as views into
+/// content. The content itself is not modified, so it can be a read only
+/// mapping of the file. The content is scanned once by scanContent, which
+/// also computes its hash, if content_hash is given.
 ///
-/// @param chapter_a The first chapter to compare.
-/// @param chapter_b The second chapter to compare.
+/// Sets error to ERR_IO if a header line is missing or contains a null byte.
 ///
-/// @return 1 if the Chapters are equal, else 0.
+/// @param content The raw chapter text, as from a file.
+/// @param length The length of content.
+/// @param title A pointer to the view of the title. Will be overwritten.
+/// @param text A pointer to the view of the text. Will be overwritten.
+/// @param options An array that will be filled with the options that are
+/// extracted.
+/// @param content_hash A pointer which will be set to the hashContent of
+/// content, NULL if the hash is not needed.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
 //
-int areEqual(Chapter *chapter_a, Chapter *chapter_b)
+void getChapterPropertiesFromText(char *content, size_t length,
+                                  StringView *title, StringView *text,
+                                  StringView options[OPTION_COUNT],
+                                  unsigned long long *content_hash, int *error)
 {
-  size_t length_a = strlen(chapter_a->text_);
-  size_t length_b = strlen(chapter_b->text_);
-  size_t memory_length_a = ((chapter_a->text_ + length_a) - chapter_a->title_);
-  size_t memory_length_b = ((chapter_b->text_ + length_b) - chapter_b->title_);
-  size_t min_size = min(memory_length_a, memory_length_b);
+  if (*error)
+  {
+    return;
+  }
+
+  ContentScan scan;
+  scanContent(content, length, content_hash ? SCAN_HASH : 0, &scan);
+  if (content_hash)
+  {
+    *content_hash = scan.hash_;
+  }
+  if (scan.new_line_count_ < HEADER_LINE_COUNT ||
+      (scan.first_null_ &&
+       scan.first_null_ < scan.new_lines_[HEADER_LINE_COUNT - 1]))
+  {
+    *error = ERR_IO;
+    return;
+  }
+
+  char *line_start = content;
+  for (int line = 0; line < HEADER_LINE_COUNT; line++)
+  {
+    StringView *field = line ? options + line - 1 : title;
+    field->start_ = line_start;
+    field->length_ = scan.new_lines_[line] - line_start;
+    line_start = scan.new_lines_[line] + 1;
+  }
 
-  return length_a == length_b
-         && !memcmp(chapter_a->title_, chapter_b->title_, min_size);
+  // The text ends at the first null byte, like a C-String would
+  text->start_ = line_start;
+  text->length_ = (scan.first_null_ ? scan.first_null_ : content + length) -
+                  line_start;
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Resizes the map by size.
-/// If the allocation fails, the size will be halfed until the size is 1 and
-/// then returns 0 and sets the error to ERR_OUT_OF_MEMORY.
+/// Scans content in a single pass for the newlines which end the header
+/// lines and for the first null byte. If SCAN_HASH is set in scan_flags, the
+/// hashContent of content is computed in the same pass, otherwise the scan
+/// stops as soon as everything is found.
+/// With SSE2, 16 bytes are compared at once. The rest and builds without SSE2
+/// are scanned byte by byte.
 ///
-/// @param map The map that should be resized.
-/// @param size The size by which the map should be longer.
-/// @param error The error pointer that will be set if an error occurs.
+/// @param content The raw chapter text, can contain null bytes.
+/// @param length The length of content.
+/// @param scan_flags The SCAN_ flags determining what is computed.
+/// @param scan The ContentScan which will be filled.
 ///
 /// @return nothing
 //
-size_t resizeMap(Map *map, size_t size, int *error)
+void scanContent(char *content, size_t length, int scan_flags,
+                 ContentScan *scan)
 {
-  while (1)
+  size_t line_count = 0;
+  char *first_null = NULL;
+  unsigned long long hash = CONTENT_HASH_SEED ^ length;
+  size_t offset = 0;
+#ifdef __SSE2__
+  __m128i new_line = _mm_set1_epi8('\n');
+  __m128i null_byte = _mm_setzero_si128();
+  for (; offset + sizeof(__m128i) <= length; offset += sizeof(__m128i))
   {
-    MapEntry *temporary_map_entry =
-        realloc(map->start_entry_, (map->length_ + size) * sizeof(MapEntry));
-    if (temporary_map_entry != NULL)
+    __m128i block = _mm_loadu_si128((__m128i *) (content + offset));
+    unsigned line_mask = (unsigned) _mm_movemask_epi8(
+        _mm_cmpeq_epi8(block, new_line));
+    unsigned null_mask = (unsigned) _mm_movemask_epi8(
+        _mm_cmpeq_epi8(block, null_byte));
+    while (line_mask && line_count < HEADER_LINE_COUNT)
     {
-      map->start_entry_ = temporary_map_entry;
-      return size;
+      scan->new_lines_[line_count++] = content + offset +
+                                       __builtin_ctz(line_mask);
+      line_mask &= line_mask - 1;
     }
-    if (size == 1)
+    if (null_mask && !first_null)
     {
-      *error = ERR_OUT_OF_MEMORY;
-      return 0;
+      first_null = content + offset + __builtin_ctz(null_mask);
     }
-    size /= 2;
+    if (scan_flags & SCAN_HASH)
+    {
+      hash = mixContentHash(hash, content + offset, sizeof(__m128i));
+    }
+    else if (line_count == HEADER_LINE_COUNT && first_null)
+    {
+      break;
+    }
+  }
+#endif
+  size_t hashed_length = offset;
+  for (; offset < length && (line_count < HEADER_LINE_COUNT || !first_null);
+       offset++)
+  {
+    if (content[offset] == '\n' && line_count < HEADER_LINE_COUNT)
+    {
+      scan->new_lines_[line_count++] = content + offset;
+    }
+    else if (content[offset] == '\0' && !first_null)
+    {
+      first_null = content + offset;
+    }
+  }
+  if (scan_flags & SCAN_HASH)
+  {
+    hash = mixContentHash(hash, content + hashed_length,
+                          length - hashed_length);
+    scan->hash_ = finishContentHash(hash);
+  }
+  for (size_t line = line_count; line < HEADER_LINE_COUNT; line++)
+  {
+    scan->new_lines_[line] = NULL;
   }
+  scan->new_line_count_ = line_count;
+  scan->first_null_ = first_null;
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Allocates memory for a MapEntry array of size size.
-/// If the allocation fails, the size will be halfed until the size is 1 and
-/// then returns 0 and sets the error to ERR_OUT_OF_MEMORY.
+/// Copies the content of view into a newly allocated null terminated string.
 ///
-/// @param array The reference to the pointer on which the created array should
-/// be accessible.
-/// @param size The initial size of the created array.
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param view The view that should be copied.
+/// @param string The reference to the pointer on which the created string
+/// will be accessible.
 /// @param error The error pointer that will be set if an error occurs.
 ///
 /// @return nothing
 //
-size_t createMapEntryArray(MapEntry **array, size_t size, int *error)
+void copyStringView(StringView view, char **string, int *error)
 {
-  while (1)
+  if (*error)
   {
-    *array = (MapEntry *) malloc(size * sizeof(MapEntry));
-    if (*array != NULL)
-    {
-      return size;
-    }
+    return;
+  }
 
-    if (size == 1)
-    {
-      *error = ERR_OUT_OF_MEMORY;
-      return 0;
-    }
-    size /= 2;
+  *string = (char *) malloc(view.length_ + 1);
+  if (*string == NULL)
+  {
+    *error = ERR_OUT_OF_MEMORY;
+    return;
   }
+  memcpy(*string, view.start_, view.length_);
+  (*string)[view.length_] = '\0';
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Sets all Chapter pointers, that are equal to the one in comparison_entry to
-/// NULL.
-/// NOTE: Only subsequent entries in the map are checked.
+/// Validates the options in the options array.
+/// If the options are not valid, error will be set to ERR_IO.
 ///
-/// @param map The map containing the MapEntries
-/// @param comparison_entry The entry determining from where to start and which
-/// pointer should be set.
+/// @param options An array containing options.
+/// @param error The error pointer that will be set if an error occurs.
 ///
 /// @return nothing
 //
-void clearSameChapterPointer(Map *map, MapEntry *comparison_entry)
+void validateOptions(StringView options[OPTION_COUNT], int *error)
 {
-  for (MapEntry *entry = comparison_entry + 1;
-       entry < map->start_entry_ + map->count_;
-       entry++)
+  if (*error)
+  {
+    return;
+  }
+
+  // Checking first option for validity
+  if (!isOptionValid(options[0]))
+  {
+    *error = ERR_IO;
+    return;
+  }
+  int is_end_chapter = isEndOption(options[0]);
+
+  // Check remaining options for validity
+  for (int option_index = 1; option_index < OPTION_COUNT; option_index++)
   {
-    if (entry->value_ == comparison_entry->value_)
+    if (!isOptionValid(options[option_index]) ||
+        isEndOption(options[option_index]) != is_end_chapter)
     {
-      entry->value_ = NULL;
+      *error = ERR_IO;
+      return;
     }
   }
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Frees the memory of the given Map.
+/// Returns if option represents a valid option. E.g. if the option is not
+/// empty.
 ///
-/// @param chapter A Map* that should be freed. Can be NULL.
+/// @param option The option that should be checked.
 ///
-/// @return nothing
+/// @return If option represents a valid option. E.g. if the option is not
+/// empty.
 //
-void freeMap(Map *options_map)
+int isOptionValid(StringView option)
 {
-  if (!options_map->start_entry_)
-  {
-    return;
+  return option.length_ > 0;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Returns if option represents an "End option" e.g. if it is equal to "-".
+///
+/// @param option The option that should be checked.
+///
+/// @return If option represents an "End option" e.g. if it is equal to "-".
+//
+int isEndOption(StringView option)
+{
+  return option.length_ == 1 && option.start_[0] == '-';
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Initializes a Map, with a default length of MAP_MALLOC_INTERVALL and an
+/// empty hash index.
+///
+/// @param map A pointer to the map, that will be initialized.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void initializeMap(Map *map, int *error)
+{
+  MapEntry *map_entry;
+  size_t size = createMapEntryArray(&map_entry, MAP_MALLOC_INTERVALL, error);
+  map->start_entry_ = map_entry;
+  map->length_ = size;
+  map->count_ = 0;
+  map->buckets_ = NULL;
+  map->content_buckets_ = NULL;
+  map->file_buckets_ = NULL;
+  map->bucket_count_ = 0;
+  createMapBuckets(map, MAP_MALLOC_INTERVALL * 2, error);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Calculates the FNV-1a hash of filename.
+///
+/// @param filename The filename to hash.
+///
+/// @return The hash of filename.
+//
+size_t hashFilename(StringView filename)
+{
+  unsigned long long hash = 14695981039346656037ULL;
+  for (size_t index = 0; index < filename.length_; index++)
+  {
+    hash ^= (unsigned char) filename.start_[index];
+    hash *= 1099511628211ULL;
+  }
+  return (size_t) hash;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Determines which physical file is behind path. If the file can't be
+/// examined, the returned FileIdentity is invalid and loading it reports the
+/// error.
+///
+/// @param path The NUL terminated path of the file.
+///
+/// @return The FileIdentity of path.
+//
+FileIdentity getFileIdentity(char *path)
+{
+  FileIdentity file_identity = {0};
+  struct stat file_status;
+  if (stat(path, &file_status) == 0)
+  {
+    file_identity.device_ = file_status.st_dev;
+    file_identity.inode_ = file_status.st_ino;
+    file_identity.size_ = file_status.st_size;
+    file_identity.modified_ = file_status.st_mtim;
+    file_identity.is_valid_ = 1;
+  }
+  return file_identity;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Calculates the hash of a valid file_identity.
+///
+/// @param file_identity The FileIdentity to hash.
+///
+/// @return The hash of file_identity.
+//
+size_t hashFileIdentity(FileIdentity file_identity)
+{
+  unsigned long long hash = (unsigned long long) file_identity.inode_;
+  hash ^= (unsigned long long) file_identity.device_ * 0x9E3779B97F4A7C15ULL;
+  hash *= 0xBF58476D1CE4E5B9ULL;
+  hash ^= hash >> 31;
+  return (size_t) hash;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Searches for a Chapter loaded from the file with file_identity.
+///
+/// @param map The map, from which the chapter should be received.
+/// @param file_identity The FileIdentity of the file, can be invalid.
+///
+/// @return A pointer to the Chapter or NULL, if the file was not loaded yet.
+//
+Chapter *getChapterFromFileIdentity(Map *map, FileIdentity file_identity)
+{
+  if (!file_identity.is_valid_ || map->bucket_count_ == 0)
+  {
+    return NULL;
+  }
+
+  size_t key_hash = hashFileIdentity(file_identity);
+  size_t mask = map->bucket_count_ - 1;
+  for (size_t slot = key_hash & mask;
+       map->file_buckets_[slot].entry_index_;
+       slot = (slot + 1) & mask)
+  {
+    countStatistic(&statistics.map_probes_, 1);
+    MapBucket *bucket = map->file_buckets_ + slot;
+    if (bucket->key_hash_ != key_hash)
+    {
+      continue;
+    }
+    MapEntry *entry = map->start_entry_ + bucket->entry_index_ - 1;
+    if (entry->file_identity_.device_ == file_identity.device_
+        && entry->file_identity_.inode_ == file_identity.inode_)
+    {
+      return entry->value_;
+    }
+  }
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Calculates a 64 bit hash of the first length bytes of content. The content
+/// is processed in 8 byte words, so hashing costs about one multiplication per
+/// word.
+///
+/// @param content The content to hash, can contain null bytes.
+/// @param length The number of bytes to hash.
+///
+/// @return The hash of content.
+//
+unsigned long long hashContent(char *content, size_t length)
+{
+  return finishContentHash(mixContentHash(CONTENT_HASH_SEED ^ length,
+                                          content, length));
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Mixes the next length bytes of a content into hash. Only the last part of
+/// a content can have a length which is not a multiple of 8, it is padded
+/// with null bytes.
+///
+/// @param hash The hash of the content before words.
+/// @param words The next bytes of the content.
+/// @param length The number of bytes in words.
+///
+/// @return The updated hash.
+//
+unsigned long long mixContentHash(unsigned long long hash, char *words,
+                                  size_t length)
+{
+  size_t offset = 0;
+  for (; offset + sizeof(hash) <= length; offset += sizeof(hash))
+  {
+    unsigned long long word;
+    memcpy(&word, words + offset, sizeof(word));
+    word *= 0xBF58476D1CE4E5B9ULL;
+    word ^= word >> 31;
+    hash = (hash ^ word) * 0x94D049BB133111EBULL;
+  }
+  if (offset < length)
+  {
+    unsigned long long word = 0;
+    memcpy(&word, words + offset, length - offset);
+    word *= 0xBF58476D1CE4E5B9ULL;
+    word ^= word >> 31;
+    hash = (hash ^ word) * 0x94D049BB133111EBULL;
+  }
+  return hash;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Finalizes a hash of mixContentHash, so all bits depend on all input bits.
+///
+/// @param hash The hash of the whole content.
+///
+/// @return The final hash.
+//
+unsigned long long finishContentHash(unsigned long long hash)
+{
+  hash ^= hash >> 29;
+  hash *= 0xBF58476D1CE4E5B9ULL;
+  hash ^= hash >> 32;
+  return hash;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Replaces the hash indices of map by empty ones with bucket_count slots and
+/// inserts all entries of map into them again. The cached hashes of the
+/// entries and Chapters are used, so no key or content has to be hashed again.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails. The old indices stay
+/// valid in that case.
+///
+/// @param map The map whose index should be (re)created.
+/// @param bucket_count The new number of slots, must be a power of two.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void createMapBuckets(Map *map, size_t bucket_count, int *error)
+{
+  if (*error)
+  {
+    return;
+  }
+
+  MapBucket *buckets = (MapBucket *) calloc(bucket_count, sizeof(MapBucket));
+  MapBucket *content_buckets = (MapBucket *) calloc(bucket_count,
+                                                    sizeof(MapBucket));
+  MapBucket *file_buckets = (MapBucket *) calloc(bucket_count,
+                                                 sizeof(MapBucket));
+  if (buckets == NULL || content_buckets == NULL || file_buckets == NULL)
+  {
+    free(buckets);
+    free(content_buckets);
+    free(file_buckets);
+    *error = ERR_OUT_OF_MEMORY;
+    return;
+  }
+  free(map->buckets_);
+  free(map->content_buckets_);
+  free(map->file_buckets_);
+  map->buckets_ = buckets;
+  map->content_buckets_ = content_buckets;
+  map->file_buckets_ = file_buckets;
+  map->bucket_count_ = bucket_count;
+
+  for (size_t index = 0; index < map->count_; index++)
+  {
+    MapEntry *entry = map->start_entry_ + index;
+    insertMapBucket(map->buckets_, bucket_count, entry->key_hash_, index);
+    if (entry->owns_value_)
+    {
+      insertMapBucket(map->content_buckets_, bucket_count,
+                      (size_t) entry->value_->content_hash_, index);
+    }
+    if (entry->file_identity_.is_valid_)
+    {
+      insertMapBucket(map->file_buckets_, bucket_count,
+                      hashFileIdentity(entry->file_identity_), index);
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Puts the entry with entry_index into the first free slot of a hash index
+/// using linear probing. The index must have at least one free slot.
+///
+/// @param buckets The hash index that should be updated.
+/// @param bucket_count The number of slots of buckets, a power of two.
+/// @param key_hash The cached hash of the entry.
+/// @param entry_index The position of the entry in start_entry_.
+///
+/// @return nothing
+//
+void insertMapBucket(MapBucket *buckets, size_t bucket_count, size_t key_hash,
+                     size_t entry_index)
+{
+  size_t mask = bucket_count - 1;
+  size_t slot = key_hash & mask;
+  while (buckets[slot].entry_index_)
+  {
+    slot = (slot + 1) & mask;
+  }
+  buckets[slot].key_hash_ = key_hash;
+  buckets[slot].entry_index_ = entry_index + 1;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Searches for an entry in the map with the key in filename.
+///
+///
+/// @param map The map, from which the chapter should be received.
+/// @param filename The filename for the Chapter e.g. The key in the map.
+///
+/// @return A pointer to the Chapter or null, if no entry was found.
+//
+Chapter *getChapterFromMap(Map *map, StringView filename)
+{
+  if (map->bucket_count_ == 0)
+  {
+    return NULL;
+  }
+
+  size_t key_hash = hashFilename(filename);
+  size_t mask = map->bucket_count_ - 1;
+  for (size_t slot = key_hash & mask;
+       map->buckets_[slot].entry_index_;
+       slot = (slot + 1) & mask)
+  {
+    countStatistic(&statistics.map_probes_, 1);
+    MapBucket *bucket = map->buckets_ + slot;
+    if (bucket->key_hash_ != key_hash)
+    {
+      continue;
+    }
+    MapEntry *entry = map->start_entry_ + bucket->entry_index_ - 1;
+    if (entry->key_length_ == filename.length_
+        && memcmp(entry->key_, filename.start_, filename.length_) == 0)
+    {
+      return entry->value_;
+    }
+  }
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Returns an equal Chapter from map if one exists, else NULL.
+/// Only Chapters with the same content hash are compared, a Chapter which is
+/// already in map is returned without comparing.
+///
+/// @param map The Map in which a equal Chapter should be searched.
+/// @param chapter The Chapter for which an equal Chapter should be found.
+///
+/// @return An equal Chapter from map if one exists, else NULL.
+//
+Chapter *getEqualChapter(Map *map, Chapter *chapter)
+{
+  size_t content_hash = (size_t) chapter->content_hash_;
+  size_t mask = map->bucket_count_ - 1;
+  for (size_t slot = content_hash & mask;
+       map->content_buckets_[slot].entry_index_;
+       slot = (slot + 1) & mask)
+  {
+    countStatistic(&statistics.map_probes_, 1);
+    MapBucket *bucket = map->content_buckets_ + slot;
+    if (bucket->key_hash_ != content_hash)
+    {
+      continue;
+    }
+    Chapter *candidate = map->start_entry_[bucket->entry_index_ - 1].value_;
+    if (candidate == chapter || areEqual(candidate, chapter))
+    {
+      return candidate;
+    }
+  }
+  return NULL;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Inserts the chapter into the map. If the map has not enough space, it will
+/// be resized.
+///
+/// @param map A pointer to the map, in which chapter will be inserted.
+/// @param filename The filename e.g. The key in the map.
+/// @param file_identity The FileIdentity of filename, can be invalid.
+/// @param chapter A pointer to the chapter, that will be inserted.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return A pointer to the saved Chapter.
+//
+Chapter *insertChapterIntoMap(Map *map, StringView filename,
+                              FileIdentity file_identity, Chapter *chapter,
+                              int *error)
+{
+  if (*error)
+  {
+    return NULL;
+  }
+  if (map->count_ >= map->length_)
+  {
+    if (resizeMap(map, map->length_, error) == 0)
+    {
+      return NULL;
+    }
+  }
+  if ((map->count_ + 1) * 100 > map->bucket_count_ * MAP_MAX_LOAD_PERCENT)
+  {
+    createMapBuckets(map, map->bucket_count_ * 2, error);
+    if (*error)
+    {
+      return NULL;
+    }
+  }
+  Chapter *duplicate_chapter = getEqualChapter(map, chapter);
+
+  MapEntry *new_entry = (map->start_entry_ + map->count_);
+  new_entry->key_ = filename.start_;
+  new_entry->key_length_ = filename.length_;
+  new_entry->key_hash_ = hashFilename(filename);
+  new_entry->file_identity_ = file_identity;
+  insertMapBucket(map->buckets_, map->bucket_count_, new_entry->key_hash_,
+                  map->count_);
+  if (file_identity.is_valid_)
+  {
+    insertMapBucket(map->file_buckets_, map->bucket_count_,
+                    hashFileIdentity(file_identity), map->count_);
+  }
+
+  if (duplicate_chapter)
+  {
+    new_entry->value_ = duplicate_chapter;
+    new_entry->owns_value_ = 0;
+  }
+  else
+  {
+    new_entry->value_ = chapter;
+    new_entry->owns_value_ = 1;
+    insertMapBucket(map->content_buckets_, map->bucket_count_,
+                    (size_t) chapter->content_hash_, map->count_);
+  }
+  map->count_++;
+  return new_entry->value_;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Checks if the two given Chapter are equal.
+/// Equal is defined with having the same file content. The stored content
+/// hashes and lengths are compared first, so the content is only compared for
+/// probable duplicates.
+///
+/// @param chapter_a The first chapter to compare.
+/// @param chapter_b The second chapter to compare.
+///
+/// @return 1 if the Chapters are equal, else 0.
+//
+int areEqual(Chapter *chapter_a, Chapter *chapter_b)
+{
+  countStatistic(&statistics.content_compares_, 1);
+  return chapter_a->content_hash_ == chapter_b->content_hash_
+         && chapter_a->content_length_ == chapter_b->content_length_
+         && !memcmp(chapter_a->content_, chapter_b->content_,
+                    chapter_a->content_length_);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Resizes the entry array of the map by size.
+/// If the allocation fails, the size will be halfed until the size is 1 and
+/// then returns 0 and sets the error to ERR_OUT_OF_MEMORY.
+///
+/// @param map The map that should be resized.
+/// @param size The size by which the map should be longer.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return The size by which the map was resized or 0 on error.
+//
+size_t resizeMap(Map *map, size_t size, int *error)
+{
+  while (1)
+  {
+    MapEntry *temporary_map_entry =
+        realloc(map->start_entry_, (map->length_ + size) * sizeof(MapEntry));
+    if (temporary_map_entry != NULL)
+    {
+      map->start_entry_ = temporary_map_entry;
+      map->length_ += size;
+      return size;
+    }
+    if (size == 1)
+    {
+      *error = ERR_OUT_OF_MEMORY;
+      return 0;
+    }
+    size /= 2;
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Allocates memory for a MapEntry array of size size.
+/// If the allocation fails, the size will be halfed until the size is 1 and
+/// then returns 0 and sets the error to ERR_OUT_OF_MEMORY.
+///
+/// @param array The reference to the pointer on which the created array should
+/// be accessible.
+/// @param size The initial size of the created array.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+size_t createMapEntryArray(MapEntry **array, size_t size, int *error)
+{
+  while (1)
+  {
+    *array = (MapEntry *) malloc(size * sizeof(MapEntry));
+    if (*array != NULL)
+    {
+      return size;
+    }
+
+    if (size == 1)
+    {
+      *error = ERR_OUT_OF_MEMORY;
+      return 0;
+    }
+    size /= 2;
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Frees the memory of the given Map. Every Chapter is freed once by its
+/// owning entry, so the Map is freed in a single pass.
+///
+/// @param chapter A Map* that should be freed. Can be NULL.
+///
+/// @return nothing
+//
+void freeMap(Map *options_map)
+{
+  if (options_map->start_entry_)
+  {
+    for (MapEntry *entry = options_map->start_entry_;
+         entry < options_map->start_entry_ + options_map->count_;
+         entry++)
+    {
+      if (entry->owns_value_)
+      {
+        freeEntry(options_map, entry);
+      }
+    }
+  }
+  // Free chapter list, its index and all Chapters at once
+  free(options_map->start_entry_);
+  free(options_map->buckets_);
+  free(options_map->content_buckets_);
+  free(options_map->file_buckets_);
+  freeStoryGraph(&options_map->graph_);
+  freeTextStore(options_map->text_store_);
+  releaseArena(&options_map->chapter_arena_);
+  releaseArena(&options_map->text_arena_);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Reads the file content of file into file_buffer. If the buffer is too small
+/// its size will be doubled, so a presized buffer is filled with one fread.
+///
+/// The error will be set to ERR_IO or ERR_OUT_OF_MEMORY if an error occurs.
+///
+/// @param file A pointer to an already opened file.
+/// @param arena The Arena which owns file_buffer.
+/// @param file_buffer A pointer to a char array allocated from arena.
+/// @param buffer_size The size of the allocated char array, at least 1.
+/// @param length A pointer to the size_t, which will be set to the number of
+/// read bytes (without the null terminator).
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void readFile(FILE *file, Arena *arena, char **file_buffer,
+              size_t buffer_size, size_t *length, int *error)
+{
+  if (*error)
+  {
+    return;
+  }
+
+  size_t read = 0;
+  do
+  {
+    // Always keep one byte for the null terminator
+    read += fread(*file_buffer + read, 1, buffer_size - 1 - read, file);
+    if (ferror(file))
+    {
+      *error = ERR_IO;
+      return;
+    }
+    int next_character = EOF;
+    if (read == buffer_size - 1 && !feof(file))
+    {
+      // The buffer is full, check if the file has more content
+      next_character = getc(file);
+      if (ferror(file))
+      {
+        *error = ERR_IO;
+        return;
+      }
+    }
+    if (next_character == EOF)
+    {
+      // Set the null terminator for the string
+      *(*file_buffer + read) = '\0';
+      *length = read;
+      return;
+    }
+
+    char *temporary_file_buffer = (char *) resizeArenaAllocation(
+        arena, *file_buffer, buffer_size, buffer_size * 2, error);
+    if (temporary_file_buffer == NULL)
+    {
+      return;
+    }
+    *file_buffer = temporary_file_buffer;
+    buffer_size *= 2;
+    countStatistic(&statistics.read_resizes_, 1);
+    *(*file_buffer + read) = (char) next_character;
+    read++;
+  } while (1);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Determines the size of file by seeking to its end. The file position is
+/// reset to the start of the file afterwards.
+///
+/// @param file A pointer to an already opened file.
+///
+/// @return The size of file in bytes or 0 if the file is not seekable.
+//
+size_t getFileSize(FILE *file)
+{
+  if (fseek(file, 0, SEEK_END) != 0)
+  {
+    clearerr(file);
+    return 0;
+  }
+  long size = ftell(file);
+  if (size < 0 || fseek(file, 0, SEEK_SET) != 0)
+  {
+    clearerr(file);
+    return 0;
+  }
+  return (size_t) size;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Loads the file content and puts it onto text.
+/// If LOAD_MAPPED is set in load_flags the file is mapped read only, files
+/// that can't be mapped are read into a heap buffer.
+///
+/// The error will be set to ERR_IO or ERR_OUT_OF_MEMORY if an error occurs.
+///
+/// @param filename The file from which the text should be loaded.
+/// @param load_flags The LOAD_ flags determining how the file is loaded.
+/// @param arena The Arena which will own the text, if it is not mapped.
+/// @param text The reference to the pointer on which the text will be
+/// accessible.
+/// @param length A pointer to the size_t, which will be set to the length of
+/// the text.
+/// @param is_mapped A pointer to the int, which will be set to 1 if text is a
+/// mapping of the file.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void loadChapterText(char *filename, int load_flags, Arena *arena,
+                     char **text, size_t *length, int *is_mapped, int *error)
+{
+  if (*error)
+  {
+    return;
+  }
+
+  *is_mapped = 0;
+  if (load_flags & LOAD_MAPPED)
+  {
+    mapChapterText(filename, text, length, error);
+    if (*error || *text)
+    {
+      *is_mapped = *text != NULL;
+      return;
+    }
+  }
+
+  FILE *file = fopen(filename, "r");
+  if (file == NULL)
+  {
+    *error = ERR_IO;
+    return;
+  }
+  countStatistic(&statistics.files_opened_, 1);
+
+  // Presize the buffer, so the file can be read at once. Files that are not
+  // seekable fall back to a growing buffer.
+  size_t buffer_size = getFileSize(file) + 1;
+  if (buffer_size == 1)
+  {
+    buffer_size = FILE_BUFFER_SIZE;
+  }
+  *text = (char *) allocateFromArena(arena, buffer_size, error);
+
+  readFile(file, arena, text, buffer_size, length, error);
+  fclose(file);
+  if (!*error)
+  {
+    countStatistic(&statistics.bytes_read_, *length);
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Maps the file read only into memory and puts the mapping onto text.
+/// If the file is no regular file, is empty or can't be mapped, text is set
+/// to NULL without setting an error, so the file can be read instead.
+///
+/// The error will be set to ERR_IO if the file can't be opened.
+///
+/// @param filename The file which should be mapped.
+/// @param text The reference to the pointer on which the mapping will be
+/// accessible.
+/// @param length A pointer to the size_t, which will be set to the length of
+/// the mapping.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void mapChapterText(char *filename, char **text, size_t *length, int *error)
+{
+  *text = NULL;
+  int file_descriptor = open(filename, O_RDONLY);
+  if (file_descriptor < 0)
+  {
+    *error = ERR_IO;
+    return;
+  }
+  countStatistic(&statistics.files_opened_, 1);
+
+  struct stat file_status;
+  if (fstat(file_descriptor, &file_status) == 0
+      && S_ISREG(file_status.st_mode) && file_status.st_size > 0)
+  {
+    void *mapping = mmap(NULL, (size_t) file_status.st_size, PROT_READ,
+                         MAP_PRIVATE, file_descriptor, 0);
+    if (mapping != MAP_FAILED)
+    {
+      *text = (char *) mapping;
+      *length = (size_t) file_status.st_size;
+      countStatistic(&statistics.bytes_read_, *length);
+    }
+  }
+  close(file_descriptor);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Allocates size bytes from arena. If the current block of arena is too
+/// small, a new block is added. Allocations larger than a quarter of
+/// ARENA_BLOCK_SIZE get a block of their own, which is put behind the current
+/// block, so the current block can still be used.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param arena The Arena from which the memory is allocated.
+/// @param size The number of bytes to allocate.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return The allocated memory aligned for any type or NULL on error.
+//
+void *allocateFromArena(Arena *arena, size_t size, int *error)
+{
+  if (*error)
+  {
+    return NULL;
+  }
+
+  size_t alignment = _Alignof(max_align_t);
+  size_t header_size = (sizeof(ArenaBlock) + alignment - 1) & ~(alignment - 1);
+  size = (size + alignment - 1) & ~(alignment - 1);
+  ArenaBlock *block = arena->current_block_;
+  if (block && block->size_ - block->used_ >= size)
+  {
+    void *memory = (char *) block + header_size + block->used_;
+    block->used_ += size;
+    return memory;
+  }
+
+  int is_own_block = size > ARENA_BLOCK_SIZE / 4;
+  size_t block_size = is_own_block ? size : ARENA_BLOCK_SIZE;
+  ArenaBlock *new_block = (ArenaBlock *) malloc(header_size + block_size);
+  if (new_block == NULL)
+  {
+    *error = ERR_OUT_OF_MEMORY;
+    return NULL;
+  }
+  new_block->size_ = block_size;
+  new_block->used_ = size;
+  if (is_own_block && block)
+  {
+    new_block->previous_block_ = block->previous_block_;
+    block->previous_block_ = new_block;
+  }
+  else
+  {
+    new_block->previous_block_ = block;
+    arena->current_block_ = new_block;
+  }
+  return (char *) new_block + header_size;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Resizes the allocation memory of arena from old_size to new_size. If it is
+/// the last allocation of the current block and fits, it grows in place,
+/// otherwise it is copied into a new allocation.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param arena The Arena which owns memory.
+/// @param memory The allocation that should be resized.
+/// @param old_size The size with which memory was allocated.
+/// @param new_size The new size, larger than old_size.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return The resized allocation or NULL on error.
+//
+void *resizeArenaAllocation(Arena *arena, void *memory, size_t old_size,
+                            size_t new_size, int *error)
+{
+  if (*error)
+  {
+    return NULL;
+  }
+
+  size_t alignment = _Alignof(max_align_t);
+  size_t header_size = (sizeof(ArenaBlock) + alignment - 1) & ~(alignment - 1);
+  size_t aligned_old_size = (old_size + alignment - 1) & ~(alignment - 1);
+  size_t aligned_new_size = (new_size + alignment - 1) & ~(alignment - 1);
+  ArenaBlock *block = arena->current_block_;
+  if (block && (char *) memory + aligned_old_size ==
+               (char *) block + header_size + block->used_ &&
+      block->size_ - block->used_ >= aligned_new_size - aligned_old_size)
+  {
+    block->used_ += aligned_new_size - aligned_old_size;
+    return memory;
+  }
+
+  void *new_memory = allocateFromArena(arena, new_size, error);
+  if (new_memory)
+  {
+    memcpy(new_memory, memory, old_size);
+  }
+  return new_memory;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Gives the allocation memory back to arena, if it is the last allocation of
+/// the current block. Other allocations stay until the Arena is released.
+///
+/// @param arena The Arena which owns memory.
+/// @param memory The allocation that should be freed.
+/// @param size The size with which memory was allocated.
+///
+/// @return nothing
+//
+void freeArenaAllocation(Arena *arena, void *memory, size_t size)
+{
+  size_t alignment = _Alignof(max_align_t);
+  size_t header_size = (sizeof(ArenaBlock) + alignment - 1) & ~(alignment - 1);
+  size = (size + alignment - 1) & ~(alignment - 1);
+  ArenaBlock *block = arena->current_block_;
+  if (block && block->used_ >= size &&
+      (char *) memory == (char *) block + header_size + block->used_ - size)
+  {
+    block->used_ -= size;
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Moves all blocks of source into destination, so they are released
+/// together with destination. The current block of destination stays the
+/// current one and source is empty afterwards.
+///
+/// @param destination The Arena which takes over the blocks.
+/// @param source The Arena whose blocks are moved.
+///
+/// @return nothing
+//
+void mergeArena(Arena *destination, Arena *source)
+{
+  ArenaBlock *first_block = source->current_block_;
+  if (first_block == NULL)
+  {
+    return;
+  }
+  source->current_block_ = NULL;
+  if (destination->current_block_ == NULL)
+  {
+    destination->current_block_ = first_block;
+    return;
+  }
+
+  ArenaBlock *last_block = first_block;
+  while (last_block->previous_block_)
+  {
+    last_block = last_block->previous_block_;
+  }
+  last_block->previous_block_ = destination->current_block_->previous_block_;
+  destination->current_block_->previous_block_ = first_block;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Frees all blocks of arena and with them all allocations.
+///
+/// @param arena The Arena that should be released.
+///
+/// @return nothing
+//
+void releaseArena(Arena *arena)
+{
+  ArenaBlock *block = arena->current_block_;
+  while (block)
+  {
+    ArenaBlock *previous_block = block->previous_block_;
+    free(block);
+    block = previous_block;
+  }
+  arena->current_block_ = NULL;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Frees the memory of the given MapEntry.
+///
+/// @param map The Map containing entry.
+/// @param chapter A MapEntry* that should be freed. Can be NULL.
+///
+/// @return nothing
+//
+void freeEntry(Map *map, MapEntry *entry)
+{
+  if (!entry)
+  {
+    return;
+  }
+  free(entry->value_->parents_);
+  freeChapter(map, entry->value_);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Frees the memory of the given Chapter. Its memory is given back to the
+/// Arenas of map, if it was the last allocation, e.g. for a duplicate that
+/// was just loaded.
+///
+/// @param map The Map whose Arenas own the Chapter.
+/// @param chapter A Chapter* that should be freed. Can be NULL.
+///
+/// @return nothing
+//
+void freeChapter(Map *map, Chapter *chapter)
+{
+  if (!chapter)
+  {
+    return;
+  }
+
+  char *content = chapter->content_;
+  size_t content_length = chapter->content_length_;
+  int is_mapped = chapter->is_mapped_;
+  freeChapterContent(chapter);
+  freeArenaAllocation(&map->chapter_arena_, chapter, sizeof(Chapter));
+  if (!is_mapped && content)
+  {
+    freeArenaAllocation(&map->text_arena_, content, content_length + 1);
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Unmaps the file content of the given Chapter, if it is mapped. Other
+/// contents are owned by an Arena.
+///
+/// @param chapter A Chapter* whose content should be freed.
+///
+/// @return nothing
+//
+void freeChapterContent(Chapter *chapter)
+{
+  if (chapter->is_mapped_)
+  {
+    munmap(chapter->content_, chapter->content_length_);
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Prints an error message for the given error_code.
+///
+/// @param error_code The error code for which an error message should be
+/// printed.
+/// @param argument char argument for error code ERR_IO, to provide the file
+/// for which the message should be printed. If NULL, the ERR_IO will not be
+/// printed.
+///
+/// @return nothing
+//
+void printError(const int error_code, char *argument)
+{
+  switch (error_code)
+  {
+    case ERR_INVALID_ARGUMENTS:
+      printf("Usage: ./ass2 [file-name]\n");
+      break;
+    case ERR_IO:
+      if (argument)
+      {
+        printf("[ERR] Could not read file %s.\n", argument);
+      }
+      break;
+    case ERR_WRITE:
+      if (argument)
+      {
+        printf("[ERR] Could not write file %s.\n", argument);
+      }
+      break;
+    case ERR_SERVE:
+      if (argument)
+      {
+        printf("[ERR] Could not serve on %s.\n", argument);
+      }
+      break;
+    case ERR_OUT_OF_MEMORY:
+      printf("[ERR] Out of memory.\n");
+      break;
+    default:
+      return;
+  }
+
+}
+
+/**
+ *
+ * Graph functions
+ *
+ */
+
+// A node on the depth first search stack of traverseStoryGraph, together
+// with its next edge that has to be visited
+typedef struct _StoryGraphFrame_
+{
+  uint32_t node_;
+  uint32_t next_edge_;
+} StoryGraphFrame;
+
+#define ANALYSIS_CHUNK_SIZE 1024
+#define ANALYSIS_BATCH_SIZE 256
+#define ANALYSIS_WORD_BITS 32
+
+// The shared state of the threads of analyzeStoryGraphInParallel. The
+// queue holds the nodes in the order their distance to an end is found, the
+// current frontier of the breadth first search is queue_[level_start_] up
+// to queue_[level_end_ - 1]. The threads take chunks of work at next_work_
+// and meet in waitForAnalysisStep after every step.
+typedef struct _ParallelAnalysis_
+{
+  StoryGraph *graph_;
+  atomic_uint *visited_;  // One bit per node, set once its distance is known
+  uint32_t *queue_;
+  atomic_uint queue_end_;
+  uint32_t level_start_;
+  uint32_t level_end_;
+  atomic_uint next_work_;
+  mtx_t lock_;
+  cnd_t step_done_;
+  size_t thread_count_;
+  size_t waiting_count_;
+  size_t step_;
+  int is_finished_;
+} ParallelAnalysis;
+
+void buildStoryGraph(Map *, StoryGraph *, int *);
+
+void traverseStoryGraph(StoryGraph *, int *);
+
+void visitStoryGraphNode(StoryGraph *, uint32_t, uint32_t *, uint32_t *,
+                         StoryGraphFrame *, uint32_t *, uint32_t *,
+                         uint32_t *, uint32_t *);
+
+void evaluateStoryGraphComponent(StoryGraph *, uint32_t, uint32_t *,
+                                 uint32_t *);
+
+GraphClass getGraphClass(StoryGraph *);
+
+void computeEndDistances(StoryGraph *, int *);
+
+void setBestOption(StoryGraph *, uint32_t);
+
+void analyzeStoryGraphInParallel(StoryGraph *, size_t, int *);
+
+int runAnalysisThread(void *);
+
+void queueAnalyzedNode(ParallelAnalysis *, uint32_t *, uint32_t *, uint32_t);
+
+void flushAnalyzedNodes(ParallelAnalysis *, uint32_t *, uint32_t *);
+
+void waitForAnalysisStep(ParallelAnalysis *);
+
+//-----------------------------------------------------------------------------
+///
+/// Analyzes the Graph represented by the Chapter.
+/// It will be analyzed if the Graph:
+/// - Contains loops
+///   - If the loop can be exited
+/// - Has an end
+///
+/// The analysis is iterative and visits every node and option once, so it
+/// needs O(V + E) time and no recursion. It runs on the StoryGraph of map,
+/// which is built first and kept for playing. The distances of all nodes to
+/// the nearest end are computed as well. With load threads the analysis
+/// runs on as many threads, see analyzeStoryGraphInParallel.
+///
+/// @param map The map containing all Chapters/the Graph to analyze.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return The GraphClass of the Graph in map.
+//
+GraphClass analyzeGameGraph(Map *map, int *error)
+{
+  if (*error)
+  {
+    return NO_END;
+  }
+
+  // Traverse graph and analyze each node
+  StoryGraph *graph = &map->graph_;
+  buildStoryGraph(map, graph, error);
+  if (map->load_thread_count_)
+  {
+    analyzeStoryGraphInParallel(graph, map->load_thread_count_, error);
+  }
+  else
+  {
+    traverseStoryGraph(graph, error);
+    computeEndDistances(graph, error);
+  }
+  if (*error)
+  {
+    return NO_END;
+  }
+
+  // The Chapters keep a copy of their state, which the Watcher updates
+  // incrementally
+  for (uint32_t node = 0; node < graph->node_count_; node++)
+  {
+    graph->chapters_[node]->graph_analyze_state_ = graph->node_states_[node];
+  }
+
+  // Iterate through the graph and evaluate the current loaded adventure
+  GraphClass result = getGraphClass(graph);
+  printGraphClass(result);
+  return result;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Prints an info message, if the adventure with graph_class can't be played
+/// normally.
+///
+/// @param graph_class The GraphClass of the loaded adventure.
+///
+/// @return nothing
+//
+void printGraphClass(GraphClass graph_class)
+{
+  switch (graph_class)
+  {
+    case NO_END:
+      // This also implies that there is a circle
+      printf("[INFO] The loaded adventure has no reachable end!\n");
+      break;
+
+    case HAS_MAZE:
+      // This also implies that there is a circle, that you can't get out of.
+      printf(
+          "[INFO] The loaded adventure contains a path that leads to a maze,"
+              " that can't be exited anymore!\n");
+      break;
+
+    default:
+      break;
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Builds the StoryGraph of the unique Chapters of map and its predecessor
+/// index. The Chapters are numbered by numberChapters, so the start Chapter
+/// is node 0.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param map The map containing all Chapters.
+/// @param graph The StoryGraph that will be built.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void buildStoryGraph(Map *map, StoryGraph *graph, int *error)
+{
+  if (*error)
+  {
+    return;
+  }
+
+  size_t node_count = numberChapters(map);
+  graph->node_count_ = (uint32_t) node_count;
+  graph->edge_starts_ = (uint32_t *) malloc((node_count + 1) *
+                                            sizeof(uint32_t));
+  graph->edges_ = (uint32_t *) malloc(node_count * OPTION_COUNT *
+                                      sizeof(uint32_t));
+  graph->predecessor_starts_ = (uint32_t *) calloc(node_count + 1,
+                                                   sizeof(uint32_t));
+  graph->predecessors_ = (uint32_t *) malloc(node_count * OPTION_COUNT *
+                                             sizeof(uint32_t));
+  graph->chapters_ = (Chapter **) malloc(node_count * sizeof(Chapter *));
+  graph->node_states_ = (signed char *) malloc(node_count);
+  graph->components_ = (uint32_t *) malloc(node_count * sizeof(uint32_t));
+  graph->component_count_ = 0;
+  graph->end_distances_ = (uint32_t *) malloc(node_count * sizeof(uint32_t));
+  graph->best_options_ = (unsigned char *) malloc(node_count);
+  if (graph->edge_starts_ == NULL || graph->edges_ == NULL ||
+      graph->predecessor_starts_ == NULL || graph->predecessors_ == NULL ||
+      graph->chapters_ == NULL || graph->node_states_ == NULL ||
+      graph->components_ == NULL || graph->end_distances_ == NULL ||
+      graph->best_options_ == NULL)
+  {
+    freeStoryGraph(graph);
+    *error = ERR_OUT_OF_MEMORY;
+    return;
+  }
+
+  for (MapEntry *entry = map->start_entry_;
+       entry < map->start_entry_ + map->count_;
+       entry++)
+  {
+    graph->chapters_[entry->value_->graph_index_] = entry->value_;
+  }
+  uint32_t edge_count = 0;
+  for (uint32_t node = 0; node < graph->node_count_; node++)
+  {
+    graph->edge_starts_[node] = edge_count;
+    Chapter *chapter = graph->chapters_[node];
+    for (int option_index = 0; option_index < OPTION_COUNT; option_index++)
+    {
+      if (chapter->options_[option_index])
+      {
+        graph->edges_[edge_count++] =
+            (uint32_t) chapter->options_[option_index]->graph_index_;
+      }
+    }
+  }
+  graph->edge_starts_[graph->node_count_] = edge_count;
+
+  // Sort the edges by their target to get the predecessors. The starts are
+  // counted one node ahead, so filling them moves them to their place.
+  for (uint32_t edge = 0; edge < edge_count; edge++)
+  {
+    graph->predecessor_starts_[graph->edges_[edge] + 1]++;
+  }
+  for (uint32_t node = 0; node < graph->node_count_; node++)
+  {
+    graph->predecessor_starts_[node + 1] += graph->predecessor_starts_[node];
+  }
+  for (uint32_t node = graph->node_count_; node > 0; node--)
+  {
+    graph->predecessor_starts_[node] = graph->predecessor_starts_[node - 1];
+  }
+  for (uint32_t node = 0; node < graph->node_count_; node++)
+  {
+    for (uint32_t edge = graph->edge_starts_[node];
+         edge < graph->edge_starts_[node + 1];
+         edge++)
+    {
+      graph->predecessors_[graph->predecessor_starts_[graph->edges_[edge] +
+                                                      1]++] = node;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Frees the arrays of graph. Can be called for an unbuilt StoryGraph.
+///
+/// @param graph The StoryGraph that should be freed.
+///
+/// @return nothing
+//
+void freeStoryGraph(StoryGraph *graph)
+{
+  free(graph->edge_starts_);
+  free(graph->edges_);
+  free(graph->predecessor_starts_);
+  free(graph->predecessors_);
+  free(graph->chapters_);
+  free(graph->node_states_);
+  free(graph->components_);
+  free(graph->end_distances_);
+  free(graph->best_options_);
+  graph->node_count_ = 0;
+  graph->edge_starts_ = NULL;
+  graph->edges_ = NULL;
+  graph->predecessor_starts_ = NULL;
+  graph->predecessors_ = NULL;
+  graph->chapters_ = NULL;
+  graph->node_states_ = NULL;
+  graph->components_ = NULL;
+  graph->component_count_ = 0;
+  graph->end_distances_ = NULL;
+  graph->best_options_ = NULL;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Finds the strongly connected components of graph with an iterative
+/// version of Tarjan's algorithm and evaluates them. A component is
+/// finished only after all components reachable from it, so it leads to an
+/// end if one of its nodes has no edges or an edge into an already finished
+/// component that leads to an end.
+///
+/// After the traversal every node reachable from node 0 is either
+/// LEADS_TO_END or DEAD_END in node_states_.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param graph The StoryGraph that should be analyzed.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void traverseStoryGraph(StoryGraph *graph, int *error)
+{
+  if (*error)
+  {
+    return;
+  }
+
+  uint32_t node_count = graph->node_count_;
+  uint32_t *indices = (uint32_t *) malloc(node_count * sizeof(uint32_t));
+  uint32_t *low_links = (uint32_t *) malloc(node_count * sizeof(uint32_t));
+  StoryGraphFrame *frames = (StoryGraphFrame *) malloc(
+      node_count * sizeof(StoryGraphFrame));
+  uint32_t *component_stack = (uint32_t *) malloc(node_count *
+                                                  sizeof(uint32_t));
+  if (indices == NULL || low_links == NULL || frames == NULL ||
+      component_stack == NULL)
+  {
+    *error = ERR_OUT_OF_MEMORY;
+  }
+  else if (node_count)
+  {
+    memset(graph->node_states_, UNVISITED, node_count);
+    graph->component_count_ = 0;
+    uint32_t frame_count = 0;
+    uint32_t component_count = 0;
+    uint32_t next_index = 1;
+    visitStoryGraphNode(graph, 0, indices, low_links, frames, &frame_count,
+                        component_stack, &component_count, &next_index);
+
+    while (frame_count)
+    {
+      StoryGraphFrame *frame = frames + frame_count - 1;
+      uint32_t node = frame->node_;
+      if (frame->next_edge_ < graph->edge_starts_[node + 1])
+      {
+        uint32_t child = graph->edges_[frame->next_edge_++];
+        if (graph->node_states_[child] == UNVISITED)
+        {
+          visitStoryGraphNode(graph, child, indices, low_links, frames,
+                              &frame_count, component_stack,
+                              &component_count, &next_index);
+        }
+        else if (graph->node_states_[child] == PROCESSING &&
+                 indices[child] < low_links[node])
+        {
+          low_links[node] = indices[child];
+        }
+        continue;
+      }
+
+      // All edges are visited, return to the parent node
+      frame_count--;
+      if (frame_count && low_links[node] < low_links[frames[frame_count -
+                                                            1].node_])
+      {
+        low_links[frames[frame_count - 1].node_] = low_links[node];
+      }
+      if (low_links[node] == indices[node])
+      {
+        evaluateStoryGraphComponent(graph, node, component_stack,
+                                    &component_count);
+      }
+    }
+  }
+  free(indices);
+  free(low_links);
+  free(frames);
+  free(component_stack);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Numbers node and pushes it onto the depth first search stack and the stack
+/// of the current components.
+///
+/// @param graph The StoryGraph that is analyzed.
+/// @param node The node that is visited.
+/// @param indices The visit number of every node.
+/// @param low_links The lowest visit number reachable from every node.
+/// @param frames The depth first search stack.
+/// @param frame_count A pointer to the number of frames.
+/// @param component_stack The stack of the nodes of unfinished components.
+/// @param component_count A pointer to the number of nodes on component_stack.
+/// @param next_index A pointer to the next free visit number.
+///
+/// @return nothing
+//
+void visitStoryGraphNode(StoryGraph *graph, uint32_t node, uint32_t *indices,
+                         uint32_t *low_links, StoryGraphFrame *frames,
+                         uint32_t *frame_count, uint32_t *component_stack,
+                         uint32_t *component_count, uint32_t *next_index)
+{
+  countStatistic(&statistics.graph_visits_, 1);
+  graph->node_states_[node] = PROCESSING;
+  indices[node] = *next_index;
+  low_links[node] = *next_index;
+  ++*next_index;
+
+  frames[*frame_count].node_ = node;
+  frames[*frame_count].next_edge_ = graph->edge_starts_[node];
+  ++*frame_count;
+  component_stack[(*component_count)++] = node;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Evaluates the component with the root node, pops its nodes from the
+/// component stack, sets their state to LEADS_TO_END or DEAD_END and numbers
+/// the component.
+///
+/// @param graph The StoryGraph that is analyzed.
+/// @param root The first visited node of the component.
+/// @param component_stack The stack of the nodes of unfinished components.
+/// @param component_count A pointer to the number of nodes on component_stack.
+///
+/// @return nothing
+//
+void evaluateStoryGraphComponent(StoryGraph *graph, uint32_t root,
+                                 uint32_t *component_stack,
+                                 uint32_t *component_count)
+{
+  uint32_t first_node = *component_count;
+  GraphNodeStatus status = DEAD_END;
+  do
+  {
+    uint32_t node = component_stack[--first_node];
+    uint32_t first_edge = graph->edge_starts_[node];
+    uint32_t last_edge = graph->edge_starts_[node + 1];
+    // Node is an end
+    if (first_edge == last_edge)
+    {
+      status = LEADS_TO_END;
+    }
+    // Node is connected to a finished node that leads to an end
+    for (uint32_t edge = first_edge; edge < last_edge; edge++)
+    {
+      if (graph->node_states_[graph->edges_[edge]] == LEADS_TO_END)
+      {
+        status = LEADS_TO_END;
+      }
+    }
+  } while (component_stack[first_node] != root);
+
+  for (uint32_t index = first_node; index < *component_count; index++)
+  {
+    graph->node_states_[component_stack[index]] = status;
+    graph->components_[component_stack[index]] = graph->component_count_;
+  }
+  graph->component_count_++;
+  *component_count = first_node;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Classifies the analyzed StoryGraph according to it's properties.
+///
+/// @param graph The analyzed StoryGraph.
+///
+/// @return The GraphClass of graph.
+//
+GraphClass getGraphClass(StoryGraph *graph)
+{
+  // Root has no child Chapter that leads to an end, that implies that there
+  // exists no reachable end in this adventure
+  if (graph->node_states_[0] != LEADS_TO_END)
+  {
+    return NO_END;
+  }
+
+  // Every node is reachable from the root, so a single node that can't reach
+  // an end implies that there must be a inescapable maze
+  for (uint32_t node = 0; node < graph->node_count_; node++)
+  {
+    if (graph->node_states_[node] != LEADS_TO_END)
+    {
+      return HAS_MAZE;
+    }
+  }
+  // If every chapter can reach an end, that means that the adventure is
+  // possible to play, every circle has at least one possible way
+  // that leads to an end
+  return POSSIBLE;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Computes for every node of graph the minimum number of choices that lead
+/// to an end and the first option which achieves it. A breadth first search
+/// starts from all ends at once and follows the predecessors, so every node
+/// and edge is visited once and the nodes are reached in the order of their
+/// distance. Nodes which can't reach an end keep NO_END_DISTANCE.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param graph The built StoryGraph.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void computeEndDistances(StoryGraph *graph, int *error)
+{
+  if (*error)
+  {
+    return;
+  }
+
+  uint32_t *queue = (uint32_t *) malloc(graph->node_count_ *
+                                        sizeof(uint32_t));
+  if (queue == NULL)
+  {
+    *error = ERR_OUT_OF_MEMORY;
+    return;
+  }
+  uint32_t queue_end = 0;
+  for (uint32_t node = 0; node < graph->node_count_; node++)
+  {
+    if (graph->edge_starts_[node] == graph->edge_starts_[node + 1])
+    {
+      graph->end_distances_[node] = 0;
+      queue[queue_end++] = node;
+    }
+    else
+    {
+      graph->end_distances_[node] = NO_END_DISTANCE;
+    }
+  }
+
+  for (uint32_t queue_start = 0; queue_start < queue_end; queue_start++)
+  {
+    uint32_t node = queue[queue_start];
+    for (uint32_t predecessor_edge = graph->predecessor_starts_[node];
+         predecessor_edge < graph->predecessor_starts_[node + 1];
+         predecessor_edge++)
+    {
+      uint32_t predecessor = graph->predecessors_[predecessor_edge];
+      if (graph->end_distances_[predecessor] != NO_END_DISTANCE)
+      {
+        continue;
+      }
+      graph->end_distances_[predecessor] = graph->end_distances_[node] + 1;
+      queue[queue_end++] = predecessor;
+    }
+  }
+  for (uint32_t node = 0; node < graph->node_count_; node++)
+  {
+    setBestOption(graph, node);
+  }
+  free(queue);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Sets the best option of node to its first option with the fewest choices
+/// to an end. Needs the end distances of all nodes.
+///
+/// @param graph The StoryGraph with the end distances.
+/// @param node The node whose best option is set.
+///
+/// @return nothing
+//
+void setBestOption(StoryGraph *graph, uint32_t node)
+{
+  graph->best_options_[node] = 0;
+  uint32_t distance = graph->end_distances_[node];
+  if (distance == 0 || distance == NO_END_DISTANCE)
+  {
+    return;
+  }
+  uint32_t first_edge = graph->edge_starts_[node];
+  uint32_t edge = first_edge;
+  while (graph->end_distances_[graph->edges_[edge]] != distance - 1)
+  {
+    edge++;
+  }
+  graph->best_options_[node] = (unsigned char) (edge - first_edge);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Analyzes graph with thread_count threads, including the calling one, and
+/// gives the same node states, distances and best options as
+/// traverseStoryGraph and computeEndDistances. A node leads to an end
+/// exactly if an end can be reached from it, so no components are needed:
+/// a breadth first search starts from all ends and follows the
+/// predecessors level by level. The threads share every level and claim the
+/// nodes of the next one with atomic visited bits, so each node gets its
+/// distance once. Every node is reachable from node 0, so the unclaimed
+/// nodes are the mazes.
+/// The components for countStoryPaths are not numbered. If no thread can be
+/// started, the calling thread does all the work. If the lock can't be
+/// created, graph is analyzed serially instead.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param graph The built StoryGraph.
+/// @param thread_count The number of threads that analyze graph.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void analyzeStoryGraphInParallel(StoryGraph *graph, size_t thread_count,
+                                 int *error)
+{
+  if (*error)
+  {
+    return;
+  }
+
+  ParallelAnalysis analysis;
+  analysis.graph_ = graph;
+  analysis.visited_ = (atomic_uint *) calloc(
+      graph->node_count_ / ANALYSIS_WORD_BITS + 1, sizeof(atomic_uint));
+  analysis.queue_ = (uint32_t *) malloc(graph->node_count_ *
+                                        sizeof(uint32_t));
+  thrd_t *threads = (thrd_t *) malloc(thread_count * sizeof(thrd_t));
+  if (analysis.visited_ == NULL || analysis.queue_ == NULL ||
+      threads == NULL)
+  {
+    free(analysis.visited_);
+    free(analysis.queue_);
+    free(threads);
+    *error = ERR_OUT_OF_MEMORY;
+    return;
+  }
+  atomic_init(&analysis.queue_end_, 0);
+  atomic_init(&analysis.next_work_, 0);
+  analysis.level_start_ = 0;
+  analysis.level_end_ = 0;
+  analysis.waiting_count_ = 0;
+  analysis.step_ = 0;
+  analysis.is_finished_ = 0;
+  int has_lock = mtx_init(&analysis.lock_, mtx_plain) == thrd_success;
+  int has_step_done = cnd_init(&analysis.step_done_) == thrd_success;
+  if (!has_lock || !has_step_done)
+  {
+    if (has_step_done)
+    {
+      cnd_destroy(&analysis.step_done_);
+    }
+    if (has_lock)
+    {
+      mtx_destroy(&analysis.lock_);
+    }
+    free(analysis.visited_);
+    free(analysis.queue_);
+    free(threads);
+    traverseStoryGraph(graph, error);
+    computeEndDistances(graph, error);
+    return;
+  }
+
+  // The threads wait for the final thread count before their first step
+  mtx_lock(&analysis.lock_);
+  size_t started_count = 0;
+  while (started_count + 1 < thread_count &&
+         thrd_create(threads + started_count, runAnalysisThread,
+                     &analysis) == thrd_success)
+  {
+    started_count++;
+  }
+  analysis.thread_count_ = started_count + 1;
+  mtx_unlock(&analysis.lock_);
+
+  runAnalysisThread(&analysis);
+  for (size_t index = 0; index < started_count; index++)
+  {
+    thrd_join(threads[index], NULL);
+  }
+  cnd_destroy(&analysis.step_done_);
+  mtx_destroy(&analysis.lock_);
+  free(analysis.visited_);
+  free(analysis.queue_);
+  free(threads);
+  graph->component_count_ = 0;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// The main function of the threads of analyzeStoryGraphInParallel. The
+/// ends are queued first, then the frontier is expanded until it is empty
+/// and finally the states and best options of all nodes are set.
+///
+/// @param argument A pointer to the ParallelAnalysis.
+///
+/// @return 0
+//
+int runAnalysisThread(void *argument)
+{
+  ParallelAnalysis *analysis = (ParallelAnalysis *) argument;
+  StoryGraph *graph = analysis->graph_;
+  uint32_t batch[ANALYSIS_BATCH_SIZE];
+  uint32_t batch_count = 0;
+
+  uint32_t first_node;
+  while ((first_node = atomic_fetch_add(&analysis->next_work_,
+                                        ANALYSIS_CHUNK_SIZE)) <
+         graph->node_count_)
+  {
+    uint32_t last_node = graph->node_count_ - first_node < ANALYSIS_CHUNK_SIZE
+                         ? graph->node_count_ : first_node +
+                                                ANALYSIS_CHUNK_SIZE;
+    for (uint32_t node = first_node; node < last_node; node++)
+    {
+      graph->end_distances_[node] = NO_END_DISTANCE;
+      if (graph->edge_starts_[node] == graph->edge_starts_[node + 1])
+      {
+        graph->end_distances_[node] = 0;
+        atomic_fetch_or(analysis->visited_ + node / ANALYSIS_WORD_BITS,
+                        1u << node % ANALYSIS_WORD_BITS);
+        queueAnalyzedNode(analysis, batch, &batch_count, node);
+      }
+    }
+  }
+  flushAnalyzedNodes(analysis, batch, &batch_count);
+  waitForAnalysisStep(analysis);
+
+  while (!analysis->is_finished_)
+  {
+    uint32_t level_end = analysis->level_end_;
+    uint32_t first_index;
+    while ((first_index = atomic_fetch_add(&analysis->next_work_,
+                                           ANALYSIS_CHUNK_SIZE)) < level_end)
+    {
+      uint32_t last_index = level_end - first_index < ANALYSIS_CHUNK_SIZE
+                            ? level_end : first_index + ANALYSIS_CHUNK_SIZE;
+      countStatistic(&statistics.graph_visits_, last_index - first_index);
+      for (uint32_t index = first_index; index < last_index; index++)
+      {
+        uint32_t node = analysis->queue_[index];
+        for (uint32_t predecessor_edge = graph->predecessor_starts_[node];
+             predecessor_edge < graph->predecessor_starts_[node + 1];
+             predecessor_edge++)
+        {
+          uint32_t predecessor = graph->predecessors_[predecessor_edge];
+          unsigned bit = 1u << predecessor % ANALYSIS_WORD_BITS;
+          atomic_uint *word = analysis->visited_ + predecessor /
+                                                   ANALYSIS_WORD_BITS;
+          if ((atomic_load_explicit(word, memory_order_relaxed) & bit) ||
+              (atomic_fetch_or(word, bit) & bit))
+          {
+            continue;
+          }
+          graph->end_distances_[predecessor] = graph->end_distances_[node] +
+                                               1;
+          queueAnalyzedNode(analysis, batch, &batch_count, predecessor);
+        }
+      }
+    }
+    flushAnalyzedNodes(analysis, batch, &batch_count);
+    waitForAnalysisStep(analysis);
+  }
+
+  while ((first_node = atomic_fetch_add(&analysis->next_work_,
+                                        ANALYSIS_CHUNK_SIZE)) <
+         graph->node_count_)
+  {
+    uint32_t last_node = graph->node_count_ - first_node < ANALYSIS_CHUNK_SIZE
+                         ? graph->node_count_ : first_node +
+                                                ANALYSIS_CHUNK_SIZE;
+    for (uint32_t node = first_node; node < last_node; node++)
+    {
+      graph->node_states_[node] =
+          graph->end_distances_[node] == NO_END_DISTANCE ? DEAD_END :
+                                                           LEADS_TO_END;
+      setBestOption(graph, node);
+    }
+  }
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Adds node to the batch of a thread. A full batch is moved to the queue.
+///
+/// @param analysis The ParallelAnalysis.
+/// @param batch The batch of the thread.
+/// @param batch_count A pointer to the number of nodes in batch.
+/// @param node The node which is queued.
+///
+/// @return nothing
+//
+void queueAnalyzedNode(ParallelAnalysis *analysis, uint32_t *batch,
+                       uint32_t *batch_count, uint32_t node)
+{
+  batch[(*batch_count)++] = node;
+  if (*batch_count == ANALYSIS_BATCH_SIZE)
+  {
+    flushAnalyzedNodes(analysis, batch, batch_count);
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Moves the batch of a thread to the queue with a single atomic operation,
+/// so the threads rarely contend for the end of the queue.
+///
+/// @param analysis The ParallelAnalysis.
+/// @param batch The batch of the thread.
+/// @param batch_count A pointer to the number of nodes in batch.
+///
+/// @return nothing
+//
+void flushAnalyzedNodes(ParallelAnalysis *analysis, uint32_t *batch,
+                        uint32_t *batch_count)
+{
+  if (*batch_count == 0)
+  {
+    return;
+  }
+  uint32_t queue_index = atomic_fetch_add(&analysis->queue_end_,
+                                          *batch_count);
+  memcpy(analysis->queue_ + queue_index, batch,
+         *batch_count * sizeof(uint32_t));
+  *batch_count = 0;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Waits until all threads of analysis finished their step. The last thread
+/// makes the queued nodes the next frontier, or finishes the search if none
+/// were queued, and hands out the work of the next step.
+///
+/// @param analysis The ParallelAnalysis.
+///
+/// @return nothing
+//
+void waitForAnalysisStep(ParallelAnalysis *analysis)
+{
+  mtx_lock(&analysis->lock_);
+  size_t step = analysis->step_;
+  if (++analysis->waiting_count_ == analysis->thread_count_)
+  {
+    analysis->level_start_ = analysis->level_end_;
+    analysis->level_end_ = atomic_load(&analysis->queue_end_);
+    analysis->is_finished_ = analysis->level_start_ == analysis->level_end_;
+    atomic_store(&analysis->next_work_,
+                 analysis->is_finished_ ? 0 : analysis->level_start_);
+    analysis->waiting_count_ = 0;
+    analysis->step_++;
+    cnd_broadcast(&analysis->step_done_);
+  }
+  while (step == analysis->step_)
+  {
+    cnd_wait(&analysis->step_done_, &analysis->lock_);
+  }
+  mtx_unlock(&analysis->lock_);
+}
+
+/**
+ *
+ * Path functions
+ *
+ */
+
+#define PATH_COUNT_SATURATED UINT64_MAX
+
+uint64_t addPathCounts(uint64_t, uint64_t);
+
+void printPathCount(uint64_t);
+
+//-----------------------------------------------------------------------------
+///
+/// Counts the playthroughs of the analyzed story of map and prints them, see
+/// --paths. The StoryGraph is condensed into its strongly connected
+/// components, which form a DAG, so the counts and the longest routes are
+/// found by dynamic programming over the components in topological order in
+/// O(V + E), no matter how many paths there are.
+/// Loops are collapsed, so a counted playthrough is a sequence of choices
+/// which never returns into a component; for stories without loops these
+/// are exactly the distinct playthroughs. Counts saturate at
+/// PATH_COUNT_SATURATED. The fewest choices from the start are found by a
+/// breadth first search. The most choices are only known for Chapters that
+/// can't be reached through a loop, else they are unlimited.
+///
+/// The first line sums up the playthroughs to all endings and the fewest
+/// and most choices of one. Then every Chapter gets a tab separated line
+/// with ENDE or chapter, its file, the routes from the start to it, the
+/// routes from it to an end and the fewest and most choices from the start,
+/// the latter is "-" if it is unlimited.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param map The map containing the analyzed story.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void countStoryPaths(Map *map, int *error)
+{
+  if (*error)
+  {
+    return;
+  }
+
+  // The parallel analysis does not number the components
+  StoryGraph *graph = &map->graph_;
+  if (graph->component_count_ == 0)
+  {
+    traverseStoryGraph(graph, error);
+    if (*error)
+    {
+      return;
+    }
+  }
+  uint32_t node_count = graph->node_count_;
+  uint32_t component_count = graph->component_count_;
+  uint32_t *component_starts = (uint32_t *) calloc(component_count + 1,
+                                                   sizeof(uint32_t));
+  uint32_t *component_nodes = (uint32_t *) malloc(node_count *
+                                                  sizeof(uint32_t));
+  uint64_t *reaching_counts = (uint64_t *) calloc(component_count,
+                                                  sizeof(uint64_t));
+  uint64_t *onward_counts = (uint64_t *) calloc(component_count,
+                                                sizeof(uint64_t));
+  uint32_t *shortest_steps = (uint32_t *) malloc(node_count *
+                                                 sizeof(uint32_t));
+  uint32_t *longest_steps = (uint32_t *) calloc(component_count,
+                                                sizeof(uint32_t));
+  unsigned char *loop_reached = (unsigned char *) calloc(component_count, 1);
+  uint32_t *queue = (uint32_t *) malloc(node_count * sizeof(uint32_t));
+  MapEntry **entries = (MapEntry **) calloc(node_count, sizeof(MapEntry *));
+  if (component_starts == NULL || component_nodes == NULL ||
+      reaching_counts == NULL || onward_counts == NULL ||
+      shortest_steps == NULL || longest_steps == NULL ||
+      loop_reached == NULL || queue == NULL || entries == NULL)
+  {
+    *error = ERR_OUT_OF_MEMORY;
+  }
+  else
+  {
+    // Group the nodes by component, like the predecessors in
+    // buildStoryGraph
+    for (uint32_t node = 0; node < node_count; node++)
+    {
+      component_starts[graph->components_[node] + 1]++;
+    }
+    for (uint32_t component = 0; component < component_count; component++)
+    {
+      component_starts[component + 1] += component_starts[component];
+    }
+    for (uint32_t component = component_count; component > 0; component--)
+    {
+      component_starts[component] = component_starts[component - 1];
+    }
+    for (uint32_t node = 0; node < node_count; node++)
+    {
+      component_nodes[component_starts[graph->components_[node] + 1]++] =
+          node;
+    }
+
+    // Every node is reachable from node 0, so the search reaches all
+    for (uint32_t node = 0; node < node_count; node++)
+    {
+      shortest_steps[node] = UINT32_MAX;
+    }
+    shortest_steps[0] = 0;
+    queue[0] = 0;
+    uint32_t queue_end = 1;
+    for (uint32_t queue_index = 0; queue_index < queue_end; queue_index++)
+    {
+      uint32_t node = queue[queue_index];
+      for (uint32_t edge = graph->edge_starts_[node];
+           edge < graph->edge_starts_[node + 1];
+           edge++)
+      {
+        uint32_t target = graph->edges_[edge];
+        if (shortest_steps[target] == UINT32_MAX)
+        {
+          shortest_steps[target] = shortest_steps[node] + 1;
+          queue[queue_end++] = target;
+        }
+      }
+    }
+
+    // Edges between components lead to smaller numbers, so the routes from
+    // the start are pushed forward from the largest number downwards. A
+    // component with an edge into itself is a loop, which makes the most
+    // choices to everything after it unlimited
+    uint32_t start_component = graph->components_[0];
+    reaching_counts[start_component] = 1;
+    for (uint32_t component = component_count; component-- > 0;)
+    {
+      for (uint32_t index = component_starts[component];
+           index < component_starts[component + 1];
+           index++)
+      {
+        uint32_t node = component_nodes[index];
+        for (uint32_t edge = graph->edge_starts_[node];
+             edge < graph->edge_starts_[node + 1];
+             edge++)
+        {
+          if (graph->components_[graph->edges_[edge]] == component)
+          {
+            loop_reached[component] = 1;
+          }
+        }
+      }
+      for (uint32_t index = component_starts[component];
+           index < component_starts[component + 1];
+           index++)
+      {
+        uint32_t node = component_nodes[index];
+        for (uint32_t edge = graph->edge_starts_[node];
+             edge < graph->edge_starts_[node + 1];
+             edge++)
+        {
+          uint32_t target = graph->components_[graph->edges_[edge]];
+          if (target == component || !reaching_counts[component])
+          {
+            continue;
+          }
+          reaching_counts[target] = addPathCounts(reaching_counts[target],
+                                                  reaching_counts[component]);
+          loop_reached[target] |= loop_reached[component];
+          if (longest_steps[component] + 1 > longest_steps[target])
+          {
+            longest_steps[target] = longest_steps[component] + 1;
+          }
+        }
+      }
+    }
+
+    // The routes to an end are pulled from the smaller numbers upwards, an
+    // end is a component of its own
+    for (uint32_t component = 0; component < component_count; component++)
+    {
+      for (uint32_t index = component_starts[component];
+           index < component_starts[component + 1];
+           index++)
+      {
+        uint32_t node = component_nodes[index];
+        if (graph->edge_starts_[node] == graph->edge_starts_[node + 1])
+        {
+          onward_counts[component] = 1;
+        }
+        for (uint32_t edge = graph->edge_starts_[node];
+             edge < graph->edge_starts_[node + 1];
+             edge++)
+        {
+          uint32_t target = graph->components_[graph->edges_[edge]];
+          if (target != component)
+          {
+            onward_counts[component] = addPathCounts(
+                onward_counts[component], onward_counts[target]);
+          }
+        }
+      }
+    }
+
+    // The fewest choices to any end are already known from the analysis
+    size_t ending_count = 0;
+    int is_longest_unlimited = 0;
+    uint32_t longest_playthrough = 0;
+    for (uint32_t node = 0; node < node_count; node++)
+    {
+      uint32_t component = graph->components_[node];
+      if (graph->edge_starts_[node] == graph->edge_starts_[node + 1])
+      {
+        ending_count++;
+        is_longest_unlimited |= loop_reached[component];
+        if (longest_steps[component] > longest_playthrough)
+        {
+          longest_playthrough = longest_steps[component];
+        }
+      }
+    }
+    printf("[PATHS] ");
+    printPathCount(onward_counts[start_component]);
+    printf(" playthroughs to %zu endings", ending_count);
+    if (ending_count && is_longest_unlimited)
+    {
+      printf(", at least %u choices", graph->end_distances_[0]);
+    }
+    else if (ending_count)
+    {
+      printf(", %u to %u choices", graph->end_distances_[0],
+             longest_playthrough);
+    }
+    printf("\n");
+
+    // Every Chapter is named by the first of its files
+    for (MapEntry *entry = map->start_entry_;
+         entry < map->start_entry_ + map->count_;
+         entry++)
+    {
+      if (entries[entry->value_->graph_index_] == NULL)
+      {
+        entries[entry->value_->graph_index_] = entry;
+      }
+    }
+    for (uint32_t node = 0; node < node_count; node++)
+    {
+      uint32_t component = graph->components_[node];
+      int is_end = graph->edge_starts_[node] == graph->edge_starts_[node + 1];
+      printf("%s\t%.*s\t", is_end ? "ENDE" : "chapter",
+             (int) entries[node]->key_length_, entries[node]->key_);
+      printPathCount(reaching_counts[component]);
+      printf("\t");
+      printPathCount(onward_counts[component]);
+      printf("\t%u\t", shortest_steps[node]);
+      if (loop_reached[component])
+      {
+        printf("-\n");
+      }
+      else
+      {
+        printf("%u\n", longest_steps[component]);
+      }
+    }
+  }
+  free(component_starts);
+  free(component_nodes);
+  free(reaching_counts);
+  free(onward_counts);
+  free(shortest_steps);
+  free(longest_steps);
+  free(loop_reached);
+  free(queue);
+  free(entries);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Adds two path counts, the sum saturates at PATH_COUNT_SATURATED.
+///
+/// @param count_a The first count.
+/// @param count_b The second count.
+///
+/// @return The sum of both counts or PATH_COUNT_SATURATED.
+//
+uint64_t addPathCounts(uint64_t count_a, uint64_t count_b)
+{
+  return count_a > PATH_COUNT_SATURATED - count_b ? PATH_COUNT_SATURATED :
+                                                    count_a + count_b;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Prints a path count, a saturated count is followed by a "+".
+///
+/// @param count The path count.
+///
+/// @return nothing
+//
+void printPathCount(uint64_t count)
+{
+  printf("%llu%s", (unsigned long long) count,
+         count == PATH_COUNT_SATURATED ? "+" : "");
+}
+
+/**
+ *
+ * Text store functions
+ *
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 14
+#define LZ_LENGTH_NIBBLE 15
+#define DICTIONARY_GRAM_LENGTH 8
+#define DICTIONARY_SEGMENT_LENGTH 64
+#define DICTIONARY_SAMPLE_SIZE (4 * 1024 * 1024)
+#define DICTIONARY_HASH_BITS 16
+
+// A candidate piece of the dictionary and how often its grams occur
+typedef struct _DictionarySegment_
+{
+  size_t offset_;
+  size_t score_;
+} DictionarySegment;
+
+void trainTextDictionary(TextStore *, unsigned char *, size_t, int *);
+
+size_t scoreDictionarySegment(unsigned char *, uint32_t *, int);
+
+int compareDictionarySegments(const void *, const void *);
+
+size_t hashDictionaryGram(unsigned char *);
+
+size_t compressText(unsigned char *, size_t, size_t, uint32_t *,
+                    unsigned char *);
+
+size_t writeLzSequence(unsigned char *, size_t, unsigned char *, size_t,
+                       size_t, size_t);
+
+size_t writeLzLength(unsigned char *, size_t, size_t);
+
+int decompressText(unsigned char *, size_t, unsigned char *, size_t, size_t);
+
+//-----------------------------------------------------------------------------
+///
+/// Compresses the frames of all Chapters of the analyzed story of map and
+/// releases their file contents, see --compress. The frames are laid out in
+/// the order of the StoryGraph, so Chapters that follow each other usually
+/// share a block, and are compressed in blocks of about TEXT_BLOCK_SIZE
+/// bytes with an LZ77 codec. A dictionary trained on the frames is shared
+/// by all blocks, so even small blocks find matches for common phrases.
+/// writeChapterFrame decompresses a block on demand and keeps the last
+/// TEXT_CACHE_SIZE blocks, so a turn costs at most one block.
+/// The contents of the Map are released, the keys and title_ and text_ of
+/// the Chapters can't be used afterwards.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param map The map containing the analyzed story.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void compressStoryText(Map *map, int *error)
+{
+  if (*error)
+  {
+    return;
+  }
+
+  StoryGraph *graph = &map->graph_;
+  size_t *frame_offsets = (size_t *) malloc((graph->node_count_ + 1) *
+                                            sizeof(size_t));
+  if (frame_offsets == NULL)
+  {
+    *error = ERR_OUT_OF_MEMORY;
+    return;
+  }
+  struct iovec pieces[6];
+  size_t text_length = 0;
+  for (uint32_t node = 0; node < graph->node_count_; node++)
+  {
+    frame_offsets[node] = text_length;
+    int piece_count = getChapterFramePieces(graph->chapters_[node], pieces);
+    for (int piece = 0; piece < piece_count; piece++)
+    {
+      text_length += pieces[piece].iov_len;
+    }
+  }
+  frame_offsets[graph->node_count_] = text_length;
+
+  // The text is laid out behind room for the dictionary, so the blocks can
+  // be compressed in place
+  TextStore *store = (TextStore *) calloc(1, sizeof(TextStore));
+  unsigned char *text = (unsigned char *) malloc(TEXT_DICTIONARY_SIZE +
+                                                 text_length + 1);
+  TextBlock *blocks = (TextBlock *) calloc(graph->node_count_ + 1,
+                                           sizeof(TextBlock));
+  uint32_t *hash_table = (uint32_t *) malloc(
+      ((size_t) 1 << LZ_HASH_BITS) * sizeof(uint32_t));
+  if (store == NULL || text == NULL || blocks == NULL || hash_table == NULL)
+  {
+    free(frame_offsets);
+    free(store);
+    free(text);
+    free(blocks);
+    free(hash_table);
+    *error = ERR_OUT_OF_MEMORY;
+    return;
+  }
+  map->text_store_ = store;
+  store->blocks_ = blocks;
+  for (uint32_t node = 0; node < graph->node_count_; node++)
+  {
+    unsigned char *position = text + TEXT_DICTIONARY_SIZE +
+                              frame_offsets[node];
+    int piece_count = getChapterFramePieces(graph->chapters_[node], pieces);
+    for (int piece = 0; piece < piece_count; piece++)
+    {
+      memcpy(position, pieces[piece].iov_base, pieces[piece].iov_len);
+      position += pieces[piece].iov_len;
+    }
+  }
+
+  // Only the copied frames are needed from now on, releasing the contents
+  // first lets the compressed blocks reuse their memory
+  for (uint32_t node = 0; node < graph->node_count_; node++)
+  {
+    Chapter *chapter = graph->chapters_[node];
+    freeChapterContent(chapter);
+    chapter->content_ = NULL;
+    chapter->is_mapped_ = 0;
+    chapter->frame_ = NULL;
+    chapter->title_ = NULL;
+    chapter->text_ = NULL;
+  }
+  releaseArena(&map->text_arena_);
+  trainTextDictionary(store, text + TEXT_DICTIONARY_SIZE, text_length, error);
+  unsigned char *history = text + TEXT_DICTIONARY_SIZE -
+                           store->dictionary_length_;
+
+  // A block ends with the first frame that fills it, so no frame is split
+  size_t max_block_length = 0;
+  uint32_t first_node = 0;
+  while (first_node < graph->node_count_ && !*error)
+  {
+    uint32_t last_node = first_node + 1;
+    while (last_node < graph->node_count_ &&
+           frame_offsets[last_node] - frame_offsets[first_node] <
+           TEXT_BLOCK_SIZE)
+    {
+      last_node++;
+    }
+    size_t block_start = frame_offsets[first_node];
+    size_t block_length = frame_offsets[last_node] - block_start;
+    TextBlock *block = blocks + store->block_count_++;
+    block->store_ = store;
+    block->length_ = block_length;
+    if (block_length > max_block_length)
+    {
+      max_block_length = block_length;
+    }
+
+    // The dictionary is moved in front of every block, which overwrites
+    // the end of the already compressed text
+    unsigned char *block_history = history + block_start;
+    if (store->dictionary_length_)
+    {
+      memcpy(block_history, store->dictionary_, store->dictionary_length_);
+    }
+    unsigned char *compressed = (unsigned char *) malloc(
+        block_length + block_length / 255 + 16);
+    if (compressed == NULL)
+    {
+      *error = ERR_OUT_OF_MEMORY;
+      break;
+    }
+    block->compressed_length_ = compressText(block_history,
+                                             store->dictionary_length_,
+                                             store->dictionary_length_ +
+                                             block_length, hash_table,
+                                             compressed);
+    block->data_ = (unsigned char *) realloc(compressed,
+                                             block->compressed_length_ + 1);
+    if (block->data_ == NULL)
+    {
+      block->data_ = compressed;
+    }
+    countStatistic(&statistics.text_stored_, block_length);
+    countStatistic(&statistics.text_compressed_, block->compressed_length_);
+
+    for (uint32_t node = first_node; node < last_node; node++)
+    {
+      Chapter *chapter = graph->chapters_[node];
+      chapter->text_block_ = block;
+      chapter->frame_offset_ = frame_offsets[node] - block_start;
+      chapter->frame_length_ = frame_offsets[node + 1] - frame_offsets[node];
+    }
+    first_node = last_node;
+  }
+
+  for (size_t slot = 0; slot < TEXT_CACHE_SIZE && !*error; slot++)
+  {
+    store->cache_buffers_[slot] = (unsigned char *) malloc(
+        store->dictionary_length_ + max_block_length + 1);
+    if (store->cache_buffers_[slot] == NULL)
+    {
+      *error = ERR_OUT_OF_MEMORY;
+      break;
+    }
+    if (store->dictionary_length_)
+    {
+      memcpy(store->cache_buffers_[slot], store->dictionary_,
+             store->dictionary_length_);
+    }
+  }
+  free(frame_offsets);
+  free(text);
+  free(hash_table);
+
+#ifdef __GLIBC__
+  // The compressed blocks are spread over the heap of the released contents,
+  // so the free memory between them is only returned to the system by this
+  malloc_trim(0);
+#endif
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Returns the decompressed text of block, from the cache of its TextStore
+/// if possible. Otherwise the least recently used cache buffer is reused.
+///
+/// @param block The TextBlock that is needed.
+///
+/// @return The text of block, which stays valid until TEXT_CACHE_SIZE other
+/// blocks were requested, or NULL if block is corrupt.
+//
+char *getTextBlock(TextBlock *block)
+{
+  TextStore *store = block->store_;
+  store->use_count_++;
+  size_t oldest_slot = 0;
+  for (size_t slot = 0; slot < TEXT_CACHE_SIZE; slot++)
+  {
+    if (store->cached_blocks_[slot] == block)
+    {
+      store->cache_uses_[slot] = store->use_count_;
+      return (char *) store->cache_buffers_[slot] + store->dictionary_length_;
+    }
+    if (store->cache_uses_[slot] < store->cache_uses_[oldest_slot])
+    {
+      oldest_slot = slot;
+    }
+  }
+
+  countStatistic(&statistics.block_decodes_, 1);
+  unsigned char *buffer = store->cache_buffers_[oldest_slot];
+  store->cached_blocks_[oldest_slot] = NULL;
+  if (!decompressText(block->data_, block->compressed_length_, buffer,
+                      store->dictionary_length_, block->length_))
+  {
+    return NULL;
+  }
+  store->cached_blocks_[oldest_slot] = block;
+  store->cache_uses_[oldest_slot] = store->use_count_;
+  return (char *) buffer + store->dictionary_length_;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Frees a TextStore with all its blocks.
+///
+/// @param store The TextStore that should be freed. Can be NULL.
+///
+/// @return nothing
+//
+void freeTextStore(TextStore *store)
+{
+  if (!store)
+  {
+    return;
+  }
+  for (size_t index = 0; index < store->block_count_; index++)
+  {
+    free(store->blocks_[index].data_);
+  }
+  for (size_t slot = 0; slot < TEXT_CACHE_SIZE; slot++)
+  {
+    free(store->cache_buffers_[slot]);
+  }
+  free(store->blocks_);
+  free(store->dictionary_);
+  free(store);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Trains the dictionary of store on text. The text is cut into segments of
+/// DICTIONARY_SEGMENT_LENGTH bytes, of which at most DICTIONARY_SAMPLE_SIZE
+/// bytes are sampled evenly. A segment scores the number of times its grams
+/// of DICTIONARY_GRAM_LENGTH bytes occur in all samples. The best segments
+/// are taken as long as their grams are still frequent and not covered by a
+/// taken segment yet, the best one is put at the end of the dictionary, so
+/// it gets the shortest offsets. Small texts get no dictionary.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param store The TextStore whose dictionary is trained.
+/// @param text The text of all frames.
+/// @param text_length The length of text.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void trainTextDictionary(TextStore *store, unsigned char *text,
+                         size_t text_length, int *error)
+{
+  if (*error || text_length < 4 * TEXT_DICTIONARY_SIZE)
+  {
+    return;
+  }
+
+  size_t segment_count = DICTIONARY_SAMPLE_SIZE / DICTIONARY_SEGMENT_LENGTH;
+  size_t segment_step = text_length / segment_count;
+  if (segment_step < DICTIONARY_SEGMENT_LENGTH)
+  {
+    segment_step = DICTIONARY_SEGMENT_LENGTH;
+    segment_count = text_length / DICTIONARY_SEGMENT_LENGTH;
+  }
+  DictionarySegment *segments = (DictionarySegment *) malloc(
+      segment_count * sizeof(DictionarySegment));
+  uint32_t *gram_counts = (uint32_t *) calloc(
+      (size_t) 1 << DICTIONARY_HASH_BITS, sizeof(uint32_t));
+  store->dictionary_ = (unsigned char *) malloc(TEXT_DICTIONARY_SIZE);
+  if (segments == NULL || gram_counts == NULL || store->dictionary_ == NULL)
+  {
+    free(segments);
+    free(gram_counts);
+    *error = ERR_OUT_OF_MEMORY;
+    return;
+  }
+
+  for (size_t index = 0; index < segment_count; index++)
+  {
+    segments[index].offset_ = index * segment_step;
+    unsigned char *segment = text + segments[index].offset_;
+    for (int gram = 0;
+         gram <= DICTIONARY_SEGMENT_LENGTH - DICTIONARY_GRAM_LENGTH;
+         gram++)
+    {
+      gram_counts[hashDictionaryGram(segment + gram)]++;
+    }
+  }
+  for (size_t index = 0; index < segment_count; index++)
+  {
+    segments[index].score_ = scoreDictionarySegment(
+        text + segments[index].offset_, gram_counts, 0);
+  }
+  qsort(segments, segment_count, sizeof(DictionarySegment),
+        compareDictionarySegments);
+
+  // A segment is only worth taking if its grams occur twice on average
+  size_t minimum_score = 2 * (DICTIONARY_SEGMENT_LENGTH -
+                              DICTIONARY_GRAM_LENGTH + 1);
+  size_t dictionary_start = TEXT_DICTIONARY_SIZE;
+  for (size_t index = 0;
+       index < segment_count &&
+       dictionary_start >= DICTIONARY_SEGMENT_LENGTH &&
+       segments[index].score_ >= minimum_score;
+       index++)
+  {
+    unsigned char *segment = text + segments[index].offset_;
+    if (scoreDictionarySegment(segment, gram_counts, 0) < minimum_score)
+    {
+      continue;
+    }
+    scoreDictionarySegment(segment, gram_counts, 1);
+    dictionary_start -= DICTIONARY_SEGMENT_LENGTH;
+    memcpy(store->dictionary_ + dictionary_start, segment,
+           DICTIONARY_SEGMENT_LENGTH);
+  }
+  store->dictionary_length_ = TEXT_DICTIONARY_SIZE - dictionary_start;
+  memmove(store->dictionary_, store->dictionary_ + dictionary_start,
+          store->dictionary_length_);
+  free(segments);
+  free(gram_counts);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Sums the counts of the grams of a segment.
+///
+/// @param segment The segment of DICTIONARY_SEGMENT_LENGTH bytes.
+/// @param gram_counts The number of occurrences of every gram hash.
+/// @param is_taken If set, the counts of the grams are cleared afterwards,
+/// because the dictionary covers them now.
+///
+/// @return The score of segment.
+//
+size_t scoreDictionarySegment(unsigned char *segment, uint32_t *gram_counts,
+                              int is_taken)
+{
+  size_t score = 0;
+  for (int gram = 0;
+       gram <= DICTIONARY_SEGMENT_LENGTH - DICTIONARY_GRAM_LENGTH;
+       gram++)
+  {
+    size_t gram_hash = hashDictionaryGram(segment + gram);
+    score += gram_counts[gram_hash];
+    if (is_taken)
+    {
+      gram_counts[gram_hash] = 0;
+    }
+  }
+  return score;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Orders DictionarySegments by descending score for qsort.
+///
+/// @param segment_a The first DictionarySegment.
+/// @param segment_b The second DictionarySegment.
+///
+/// @return A negative number if segment_a scores higher, a positive number
+/// if segment_b scores higher, else 0.
+//
+int compareDictionarySegments(const void *segment_a, const void *segment_b)
+{
+  size_t score_a = ((const DictionarySegment *) segment_a)->score_;
+  size_t score_b = ((const DictionarySegment *) segment_b)->score_;
+  return (score_a < score_b) - (score_a > score_b);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Hashes the DICTIONARY_GRAM_LENGTH bytes at gram.
+///
+/// @param gram The bytes to hash.
+///
+/// @return A hash below 2 ^ DICTIONARY_HASH_BITS.
+//
+size_t hashDictionaryGram(unsigned char *gram)
+{
+  uint64_t word;
+  memcpy(&word, gram, sizeof(word));
+  return (size_t) ((word * 0x9E3779B97F4A7C15ULL) >>
+                   (64 - DICTIONARY_HASH_BITS));
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Compresses history[start] up to history[end - 1] with a greedy LZ77
+/// codec. The bytes before start, e.g. a dictionary, can be referenced but
+/// are not part of the output. The output is a list of sequences: a token
+/// with the number of literals in the high and the match length minus
+/// LZ_MIN_MATCH in the low nibble, further length bytes for nibbles of
+/// LZ_LENGTH_NIBBLE, the literals and the 2 byte offset of the match. The
+/// last sequence only has literals.
+///
+/// @param history The referenced bytes followed by the bytes to compress.
+/// @param start The first byte to compress.
+/// @param end The end of the bytes to compress.
+/// @param hash_table A table of 2 ^ LZ_HASH_BITS entries, which is
+/// overwritten.
+/// @param output The buffer for the compressed bytes, it needs room for
+/// (end - start) * 256 / 255 + 16 bytes.
+///
+/// @return The length of output.
+//
+size_t compressText(unsigned char *history, size_t start, size_t end,
+                    uint32_t *hash_table, unsigned char *output)
+{
+  memset(hash_table, 0, ((size_t) 1 << LZ_HASH_BITS) * sizeof(uint32_t));
+  for (size_t position = 0; position + LZ_MIN_MATCH <= start; position++)
+  {
+    uint32_t sequence;
+    memcpy(&sequence, history + position, sizeof(sequence));
+    hash_table[(sequence * 2654435761u) >> (32 - LZ_HASH_BITS)] =
+        (uint32_t) position + 1;
+  }
+
+  size_t output_length = 0;
+  size_t literal_start = start;
+  size_t position = start;
+  while (position + LZ_MIN_MATCH <= end)
+  {
+    uint32_t sequence;
+    memcpy(&sequence, history + position, sizeof(sequence));
+    uint32_t *slot = hash_table + ((sequence * 2654435761u) >>
+                                   (32 - LZ_HASH_BITS));
+    size_t candidate = *slot;
+    *slot = (uint32_t) position + 1;
+    uint32_t candidate_sequence = 0;
+    if (candidate)
+    {
+      memcpy(&candidate_sequence, history + candidate - 1,
+             sizeof(candidate_sequence));
+    }
+    if (!candidate || position - (candidate - 1) > LZ_MAX_OFFSET ||
+        candidate_sequence != sequence)
+    {
+      position++;
+      continue;
+    }
+
+    size_t match = candidate - 1;
+    size_t match_length = LZ_MIN_MATCH;
+    while (position + match_length < end &&
+           history[match + match_length] == history[position + match_length])
+    {
+      match_length++;
+    }
+    output_length = writeLzSequence(output, output_length,
+                                    history + literal_start,
+                                    position - literal_start,
+                                    position - match, match_length);
+    position += match_length;
+    literal_start = position;
+  }
+  return writeLzSequence(output, output_length, history + literal_start,
+                         end - literal_start, 0, 0);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Appends a sequence of compressText to output.
+///
+/// @param output The compressed bytes.
+/// @param output_length The current length of output.
+/// @param literals The literals of the sequence.
+/// @param literal_count The number of literals.
+/// @param offset The distance of the match, 0 for the last sequence.
+/// @param match_length The length of the match, 0 for the last sequence.
+///
+/// @return The new length of output.
+//
+size_t writeLzSequence(unsigned char *output, size_t output_length,
+                       unsigned char *literals, size_t literal_count,
+                       size_t offset, size_t match_length)
+{
+  size_t match_nibble = offset ? match_length - LZ_MIN_MATCH : 0;
+  unsigned char *token = output + output_length++;
+  *token = (unsigned char) (
+      ((literal_count < LZ_LENGTH_NIBBLE ? literal_count : LZ_LENGTH_NIBBLE)
+          << 4) |
+      (match_nibble < LZ_LENGTH_NIBBLE ? match_nibble : LZ_LENGTH_NIBBLE));
+  output_length = writeLzLength(output, output_length, literal_count);
+  memcpy(output + output_length, literals, literal_count);
+  output_length += literal_count;
+  if (offset)
+  {
+    output[output_length++] = (unsigned char) (offset & 0xFF);
+    output[output_length++] = (unsigned char) (offset >> 8);
+    output_length = writeLzLength(output, output_length, match_nibble);
+  }
+  return output_length;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Appends the length bytes of a length whose nibble is LZ_LENGTH_NIBBLE.
+/// They are 255 until the rest is smaller. Shorter lengths need no bytes.
+///
+/// @param output The compressed bytes.
+/// @param output_length The current length of output.
+/// @param length The literal count or match length minus LZ_MIN_MATCH.
+///
+/// @return The new length of output.
+//
+size_t writeLzLength(unsigned char *output, size_t output_length,
+                     size_t length)
+{
+  if (length < LZ_LENGTH_NIBBLE)
+  {
+    return output_length;
+  }
+  for (length -= LZ_LENGTH_NIBBLE; length >= 255; length -= 255)
+  {
+    output[output_length++] = 255;
+  }
+  output[output_length++] = (unsigned char) length;
+  return output_length;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Decompresses the output of compressText into history[start] up to
+/// history[start + length - 1]. The bytes before start have to be the ones
+/// the input was compressed with.
+///
+/// @param input The compressed bytes.
+/// @param input_length The length of input.
+/// @param history The referenced bytes, followed by room for the output.
+/// @param start The position of the output in history.
+/// @param length The length of the output.
+///
+/// @return 1 if input decompressed to exactly length bytes, else 0.
+//
+int decompressText(unsigned char *input, size_t input_length,
+                   unsigned char *history, size_t start, size_t length)
+{
+  size_t end = start + length;
+  size_t position = start;
+  unsigned char *input_end = input + input_length;
+  while (input < input_end)
+  {
+    size_t literal_count = *input >> 4;
+    size_t match_length = *input++ & LZ_LENGTH_NIBBLE;
+    if (literal_count == LZ_LENGTH_NIBBLE)
+    {
+      unsigned char length_byte;
+      do
+      {
+        if (input == input_end)
+        {
+          return 0;
+        }
+        length_byte = *input++;
+        literal_count += length_byte;
+      } while (length_byte == 255);
+    }
+    if (literal_count > (size_t) (input_end - input) ||
+        literal_count > end - position)
+    {
+      return 0;
+    }
+    memcpy(history + position, input, literal_count);
+    input += literal_count;
+    position += literal_count;
+    if (input == input_end)
+    {
+      break;
+    }
+
+    if (input_end - input < 2)
+    {
+      return 0;
+    }
+    size_t offset = input[0] | (size_t) input[1] << 8;
+    input += 2;
+    if (match_length == LZ_LENGTH_NIBBLE)
+    {
+      unsigned char length_byte;
+      do
+      {
+        if (input == input_end)
+        {
+          return 0;
+        }
+        length_byte = *input++;
+        match_length += length_byte;
+      } while (length_byte == 255);
+    }
+    match_length += LZ_MIN_MATCH;
+    if (offset == 0 || offset > position || match_length > end - position)
+    {
+      return 0;
+    }
+    // Byte by byte, because the match can overlap the output
+    unsigned char *source = history + position - offset;
+    unsigned char *destination = history + position;
+    for (size_t index = 0; index < match_length; index++)
+    {
+      destination[index] = source[index];
+    }
+    position += match_length;
+  }
+  return position == end;
+}
+
+/**
+ *
+ * Lazy loading functions
+ *
+ */
+
+//-----------------------------------------------------------------------------
+///
+/// Plays the story of start_file interactively while it is still loaded.
+/// A background thread loads and analyzes the story like the normal startup,
+/// the game starts as soon as the start Chapter is loaded, so the time until
+/// it is shown does not depend on the size of the story. Load errors and the
+/// graph class are printed when the loader finds them, a failed load ends
+/// the game at the next Chapter that could not be loaded.
+/// If no thread can be started, the story is loaded before it is played.
+/// If the lock can't be created, the story is loaded, analyzed and played
+/// like without lazy loading.
+///
+/// Sets error to the error of the loader, e.g. ERR_IO or ERR_OUT_OF_MEMORY.
+///
+/// @param map The empty Map into which the story is loaded.
+/// @param start_file The path of the first chapter file.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void playLazily(Map *map, char *start_file, int *error)
+{
+  LazyLoader lazy_loader = {
+      .has_thread_ = 0,
+      .map_ = map,
+      .start_file_ = start_file,
+      .start_chapter_ = NULL,
+      .is_finished_ = 0,
+      .error_ = 0
+  };
+  int has_lock = mtx_init(&lazy_loader.lock_, mtx_plain) == thrd_success;
+  int has_chapter_loaded = cnd_init(&lazy_loader.chapter_loaded_) ==
+                           thrd_success;
+  if (!has_lock || !has_chapter_loaded)
+  {
+    if (has_chapter_loaded)
+    {
+      cnd_destroy(&lazy_loader.chapter_loaded_);
+    }
+    if (has_lock)
+    {
+      mtx_destroy(&lazy_loader.lock_);
+    }
+    Chapter *start_chapter = NULL;
+    startPhase();
+    initializeWithFile(start_file, map, &start_chapter, error);
+    finishPhase(PHASE_LOAD);
+    analyzeGameGraph(map, error);
+    finishPhase(PHASE_ANALYSIS);
+    if (!*error)
+    {
+      startGame(start_chapter, NULL);
+      finishPhase(PHASE_PLAY);
+    }
+    return;
+  }
+  map->lazy_loader_ = &lazy_loader;
+
+  // The load phase only covers the start Chapter, the rest of the loading
+  // and the analysis overlap with the play phase
+  startPhase();
+  lazy_loader.has_thread_ = thrd_create(&lazy_loader.thread_, runLazyLoader,
+                                        &lazy_loader) == thrd_success;
+  if (!lazy_loader.has_thread_)
+  {
+    runLazyLoader(&lazy_loader);
+  }
+  mtx_lock(&lazy_loader.lock_);
+  while (!lazy_loader.start_chapter_ && !lazy_loader.is_finished_)
+  {
+    cnd_wait(&lazy_loader.chapter_loaded_, &lazy_loader.lock_);
+  }
+  Chapter *start_chapter = lazy_loader.start_chapter_;
+  mtx_unlock(&lazy_loader.lock_);
+  finishPhase(PHASE_LOAD);
+
+  if (start_chapter)
+  {
+    startGame(start_chapter, &lazy_loader);
+    finishPhase(PHASE_PLAY);
+  }
+  if (lazy_loader.has_thread_)
+  {
+    thrd_join(lazy_loader.thread_, NULL);
+  }
+  finishPhase(PHASE_ANALYSIS);
+
+  map->lazy_loader_ = NULL;
+  cnd_destroy(&lazy_loader.chapter_loaded_);
+  mtx_destroy(&lazy_loader.lock_);
+  *error = lazy_loader.error_;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// The main function of the background thread of a LazyLoader. Loads and
+/// analyzes the story and wakes up the player when it is finished.
+///
+/// @param argument A pointer to the LazyLoader.
+///
+/// @return 0
+//
+int runLazyLoader(void *argument)
+{
+  LazyLoader *lazy_loader = (LazyLoader *) argument;
+  Chapter *start_chapter = NULL;
+  int error = 0;
+  initializeWithFile(lazy_loader->start_file_, lazy_loader->map_,
+                     &start_chapter, &error);
+  analyzeGameGraph(lazy_loader->map_, &error);
+  fflush(stdout);
+
+  mtx_lock(&lazy_loader->lock_);
+  lazy_loader->error_ = error;
+  lazy_loader->is_finished_ = 1;
+  cnd_broadcast(&lazy_loader->chapter_loaded_);
+  mtx_unlock(&lazy_loader->lock_);
+  return 0;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Hands the loaded start Chapter to the player. Its options are published
+/// one by one as they are assigned.
+///
+/// @param lazy_loader The LazyLoader of the Map.
+/// @param start_chapter The start Chapter, NULL if it could not be loaded.
+///
+/// @return nothing
+//
+void publishLazyStart(LazyLoader *lazy_loader, Chapter *start_chapter)
+{
+  mtx_lock(&lazy_loader->lock_);
+  lazy_loader->start_chapter_ = start_chapter;
+  cnd_broadcast(&lazy_loader->chapter_loaded_);
+  mtx_unlock(&lazy_loader->lock_);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Assigns the loaded subchapter to the pending option and wakes up the
+/// player, which may wait for it. Options which failed to load stay pending.
+///
+/// @param lazy_loader The LazyLoader of the Map.
+/// @param option The option that was loaded.
+/// @param subchapter The Chapter of the option, NULL if it failed to load.
+///
+/// @return nothing
+//
+void publishLazyOption(LazyLoader *lazy_loader, PendingOption option,
+                       Chapter *subchapter)
+{
+  if (subchapter == NULL)
+  {
+    return;
+  }
+  mtx_lock(&lazy_loader->lock_);
+  option.chapter_->options_[option.option_index_] = subchapter;
+  option.chapter_->pending_option_count_--;
+  cnd_broadcast(&lazy_loader->chapter_loaded_);
+  mtx_unlock(&lazy_loader->lock_);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Waits until the option with option_index of chapter is loaded.
+///
+/// @param lazy_loader The LazyLoader that loads the story.
+/// @param chapter The Chapter whose option is needed.
+/// @param option_index The index of the option.
+///
+/// @return The Chapter of the option, NULL if chapter is an end or the option
+/// could not be loaded.
+//
+Chapter *waitForLazyOption(LazyLoader *lazy_loader, Chapter *chapter,
+                           int option_index)
+{
+  mtx_lock(&lazy_loader->lock_);
+  while (!chapter->options_[option_index] &&
+         chapter->pending_option_count_ && !lazy_loader->is_finished_)
+  {
+    cnd_wait(&lazy_loader->chapter_loaded_, &lazy_loader->lock_);
+  }
+  Chapter *option = chapter->options_[option_index];
+  mtx_unlock(&lazy_loader->lock_);
+  return option;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Checks if chapter is an end without waiting for its options.
+///
+/// @param lazy_loader The LazyLoader that loads the story.
+/// @param chapter The Chapter to check.
+///
+/// @return 1 if chapter is an end, else 0.
+//
+int isLazyEnd(LazyLoader *lazy_loader, Chapter *chapter)
+{
+  mtx_lock(&lazy_loader->lock_);
+  int is_end = !chapter->options_[0] && !chapter->pending_option_count_;
+  mtx_unlock(&lazy_loader->lock_);
+  return is_end;
+}
+
+/**
+ *
+ * Pack functions
+ *
+ */
+
+#define PACK_MAGIC "ASS2PACK"
+#define PACK_VERSION 2
+#define PACK_END_OPTION UINT32_MAX
+#define PACK_UNNUMBERED SIZE_MAX
+
+// The start of a pack file. It is followed by chapter_count_ PackChapters and
+// the string blob, which contains the rendered frames of the Chapters.
+typedef struct _PackHeader_
+{
+  char magic_[8];
+  uint32_t version_;
+  uint32_t graph_class_;
+  uint64_t chapter_count_;
+  uint64_t blob_length_;
+} PackHeader;
+
+// A Chapter in a pack file. The offsets are relative to the string blob, title
+// and text lie inside the frame. The options are indices into the chapter
+// table or PACK_END_OPTION.
+typedef struct _PackChapter_
+{
+  uint64_t frame_offset_;
+  uint64_t frame_length_;
+  uint64_t title_offset_;
+  uint64_t title_length_;
+  uint64_t text_offset_;
+  uint64_t text_length_;
+  uint32_t options_[OPTION_COUNT];
+} PackChapter;
+
+// A mapped pack file and the Chapters pointing into it
+typedef struct _Pack_
+{
+  char *mapping_;
+  size_t mapping_length_;
+  Chapter *chapters_;
+  size_t chapter_count_;
+  GraphClass graph_class_;
+} Pack;
+
+void loadPack(char *, Pack *, int *);
+
+void readPack(char *, size_t, Pack *, int *);
+
+void freePack(Pack *);
+
+//-----------------------------------------------------------------------------
+///
+/// Numbers the unique Chapters of map in the order of their first entry, so
+/// the first Chapter gets 0. The number is stored in graph_index_.
+///
+/// @param map The map containing the Chapters.
+///
+/// @return The number of unique Chapters.
+//
+size_t numberChapters(Map *map)
+{
+  for (MapEntry *entry = map->start_entry_;
+       entry < map->start_entry_ + map->count_;
+       entry++)
+  {
+    entry->value_->graph_index_ = PACK_UNNUMBERED;
+  }
+
+  size_t chapter_count = 0;
+  for (MapEntry *entry = map->start_entry_;
+       entry < map->start_entry_ + map->count_;
+       entry++)
+  {
+    if (entry->value_->graph_index_ == PACK_UNNUMBERED)
+    {
+      entry->value_->graph_index_ = chapter_count++;
+    }
+  }
+  return chapter_count;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Writes the story of map into a pack file, which can be played without
+/// loading, deduplicating and analyzing the chapter files again.
+///
+/// Sets error to ERR_WRITE and prints it, if the file can't be written, or
+/// to ERR_OUT_OF_MEMORY.
+///
+/// @param map The map containing the analyzed story.
+/// @param graph_class The GraphClass of the story.
+/// @param pack_file The path of the pack file that will be written.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void writePack(Map *map, GraphClass graph_class, char *pack_file, int *error)
+{
+  if (*error)
+  {
+    return;
+  }
+
+  FILE *file = fopen(pack_file, "wb");
+  int written = file != NULL && writePackData(map, graph_class, file, error);
+  if (file != NULL && fclose(file) != 0)
+  {
+    written = 0;
+  }
+  if (!written && !*error)
+  {
+    *error = ERR_WRITE;
+    printError(*error, pack_file);
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Writes the pack of the story of map at the current position of file.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param map The map containing the analyzed story.
+/// @param graph_class The GraphClass of the story.
+/// @param file The opened file into which the pack is written.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return 1 if the whole pack was written, else 0.
+//
+int writePackData(Map *map, GraphClass graph_class, FILE *file, int *error)
+{
+  size_t chapter_count = numberChapters(map);
+  PackChapter *pack_chapters = (PackChapter *) calloc(chapter_count,
+                                                      sizeof(PackChapter));
+  Chapter **chapters = (Chapter **) malloc(chapter_count * sizeof(Chapter *));
+  if (pack_chapters == NULL || chapters == NULL)
+  {
+    free(pack_chapters);
+    free(chapters);
+    *error = ERR_OUT_OF_MEMORY;
+    return 0;
+  }
+
+  // Lay out the chapter table and the blob in the order of the numbers
+  for (MapEntry *entry = map->start_entry_;
+       entry < map->start_entry_ + map->count_;
+       entry++)
+  {
+    chapters[entry->value_->graph_index_] = entry->value_;
+  }
+  uint64_t blob_length = 0;
+  for (size_t index = 0; index < chapter_count; index++)
+  {
+    Chapter *chapter = chapters[index];
+    PackChapter *pack_chapter = pack_chapters + index;
+    pack_chapter->frame_offset_ = blob_length;
+    blob_length += strlen(FRAME_SEPARATOR);
+    pack_chapter->title_offset_ = blob_length;
+    pack_chapter->title_length_ = chapter->title_length_;
+    blob_length += chapter->title_length_ + 2;
+    pack_chapter->text_offset_ = blob_length;
+    pack_chapter->text_length_ = chapter->text_length_;
+    blob_length += chapter->text_length_ + 2;
+    blob_length += strlen(chapter->options_[0] ? FRAME_PROMPT : FRAME_END);
+    pack_chapter->frame_length_ = blob_length - pack_chapter->frame_offset_;
+    for (int option_index = 0; option_index < OPTION_COUNT; option_index++)
+    {
+      Chapter *option = chapter->options_[option_index];
+      pack_chapter->options_[option_index] =
+          option ? (uint32_t) option->graph_index_ : PACK_END_OPTION;
+    }
+  }
+
+  PackHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic_, PACK_MAGIC, sizeof(header.magic_));
+  header.version_ = PACK_VERSION;
+  header.graph_class_ = (uint32_t) graph_class;
+  header.chapter_count_ = chapter_count;
+  header.blob_length_ = blob_length;
+
+  int written = fwrite(&header, sizeof(header), 1, file) == 1
+      && fwrite(pack_chapters, sizeof(PackChapter), chapter_count, file) ==
+         chapter_count;
+  for (size_t index = 0; index < chapter_count && written; index++)
+  {
+    Chapter *chapter = chapters[index];
+    char *ending = chapter->options_[0] ? FRAME_PROMPT : FRAME_END;
+    written = fputs(FRAME_SEPARATOR, file) >= 0
+              && fwrite(chapter->title_, 1, chapter->title_length_, file) ==
+                 chapter->title_length_
+              && fputs("\n\n", file) >= 0
+              && fwrite(chapter->text_, 1, chapter->text_length_, file) ==
+                 chapter->text_length_
+              && fputs("\n\n", file) >= 0
+              && fputs(ending, file) >= 0;
+  }
+  free(pack_chapters);
+  free(chapters);
+  return written;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Maps a pack file read only and creates its Chapters in a single array.
+/// Frame, title and text of the Chapters point into the mapping, so nothing
+/// is parsed or copied.
+///
+/// Sets error to ERR_IO and prints it, if the pack file can't be mapped or is
+/// invalid, or to ERR_OUT_OF_MEMORY.
+///
+/// @param pack_file The path of the pack file.
+/// @param pack A pointer to the Pack which will be filled.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void loadPack(char *pack_file, Pack *pack, int *error)
+{
+  pack->chapters_ = NULL;
+  mapChapterText(pack_file, &pack->mapping_, &pack->mapping_length_, error);
+  readPack(pack->mapping_, pack->mapping_length_, pack, error);
+  if (*error == ERR_IO)
+  {
+    printError(*error, pack_file);
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Validates the pack in data and creates its Chapters, which point into
+/// data. The mapping of pack is not touched, it has to contain data.
+///
+/// Sets error to ERR_IO, if the pack is invalid, or to ERR_OUT_OF_MEMORY.
+///
+/// @param data The pack, NULL if it could not be read.
+/// @param length The length of data.
+/// @param pack A pointer to the Pack which will be filled.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void readPack(char *data, size_t length, Pack *pack, int *error)
+{
+  if (*error)
+  {
+    return;
+  }
+
+  PackHeader *header = (PackHeader *) data;
+  uint64_t chapter_count = 0;
+  int is_valid = data != NULL
+      && length >= sizeof(PackHeader)
+      && memcmp(header->magic_, PACK_MAGIC, sizeof(header->magic_)) == 0
+      && header->version_ == PACK_VERSION
+      && header->chapter_count_ > 0
+      && header->chapter_count_ < PACK_END_OPTION
+      && (header->graph_class_ == NO_END || header->graph_class_ == POSSIBLE
+          || header->graph_class_ == HAS_MAZE);
+  if (is_valid)
+  {
+    chapter_count = header->chapter_count_;
+    is_valid = (length - sizeof(PackHeader)) / sizeof(PackChapter) >=
+               chapter_count
+               && length - sizeof(PackHeader) -
+                  chapter_count * sizeof(PackChapter) == header->blob_length_;
+  }
+  if (!is_valid)
+  {
+    *error = ERR_IO;
+    return;
+  }
+
+  PackChapter *pack_chapters = (PackChapter *) (header + 1);
+  char *blob = (char *) (pack_chapters + chapter_count);
+  pack->chapter_count_ = chapter_count;
+  pack->graph_class_ = (GraphClass) header->graph_class_;
+  pack->chapters_ = (Chapter *) calloc(chapter_count, sizeof(Chapter));
+  if (pack->chapters_ == NULL)
+  {
+    *error = ERR_OUT_OF_MEMORY;
+    return;
+  }
+
+  for (size_t index = 0; index < chapter_count && !*error; index++)
+  {
+    PackChapter *pack_chapter = pack_chapters + index;
+    Chapter *chapter = pack->chapters_ + index;
+    if (pack_chapter->frame_length_ > header->blob_length_ ||
+        pack_chapter->frame_offset_ >
+        header->blob_length_ - pack_chapter->frame_length_ ||
+        pack_chapter->title_length_ > header->blob_length_ ||
+        pack_chapter->title_offset_ >
+        header->blob_length_ - pack_chapter->title_length_ ||
+        pack_chapter->text_length_ > header->blob_length_ ||
+        pack_chapter->text_offset_ >
+        header->blob_length_ - pack_chapter->text_length_)
+    {
+      *error = ERR_IO;
+      break;
+    }
+    chapter->frame_ = blob + pack_chapter->frame_offset_;
+    chapter->frame_length_ = pack_chapter->frame_length_;
+    chapter->title_ = blob + pack_chapter->title_offset_;
+    chapter->title_length_ = pack_chapter->title_length_;
+    chapter->text_ = blob + pack_chapter->text_offset_;
+    chapter->text_length_ = pack_chapter->text_length_;
+
+    int is_end_chapter = pack_chapter->options_[0] == PACK_END_OPTION;
+    for (int option_index = 0; option_index < OPTION_COUNT; option_index++)
+    {
+      uint32_t option = pack_chapter->options_[option_index];
+      if ((option == PACK_END_OPTION) != is_end_chapter ||
+          (!is_end_chapter && option >= chapter_count))
+      {
+        *error = ERR_IO;
+        break;
+      }
+      chapter->options_[option_index] =
+          is_end_chapter ? NULL : pack->chapters_ + option;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Frees the Chapters of pack and unmaps its file.
+///
+/// @param pack The Pack that should be freed.
+///
+/// @return nothing
+//
+void freePack(Pack *pack)
+{
+  free(pack->chapters_);
+  if (pack->mapping_)
+  {
+    munmap(pack->mapping_, pack->mapping_length_);
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Plays the story of a pack file, using the graph analysis stored in it.
+///
+/// @param arguments The parsed command line arguments, the start file is the
+/// pack file.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void playPack(Arguments *arguments, int *error)
+{
+  Pack pack;
+  startPhase();
+  loadPack(arguments->start_file_, &pack, error);
+  finishPhase(PHASE_LOAD);
+  if (!*error)
+  {
+    printGraphClass(pack.graph_class_);
+    playStory(pack.chapters_, NULL, arguments, error);
+    finishPhase(PHASE_PLAY);
+  }
+  startPhase();
+  freePack(&pack);
+  finishPhase(PHASE_TEARDOWN);
+}
+
+/**
+ *
+ * Cache functions
+ *
+ */
+
+#define CACHE_MAGIC "ASS2CACH"
+#define CACHE_VERSION 1
+#define CACHE_SUFFIX ".cache"
+#define CACHE_TEMPORARY_SUFFIX ".XXXXXX"
+// Files modified less than this many seconds before the load started are not
+// cached, a change in the same second would not change their mtime
+#define CACHE_RACY_SECONDS 2
+// The mode of a written cache before the umask is applied, mkstemp creates
+// it readable only by its owner
+#define CACHE_FILE_MODE 0644
+
+// The start of a cache file. It is followed by file_count_ CacheFiles, the
+// NUL terminated paths of the files and, at pack_offset_, the pack of the
+// story as written by writePackData.
+typedef struct _CacheHeader_
+{
+  char magic_[8];
+  uint32_t version_;
+  uint32_t file_count_;
+  uint64_t paths_length_;
+  uint64_t pack_offset_;
+} CacheHeader;
+
+// A path of the cached story and the file behind it when it was loaded. The
+// path offset is relative to the paths.
+typedef struct _CacheFile_
+{
+  uint64_t path_offset_;
+  uint64_t device_;
+  uint64_t inode_;
+  uint64_t size_;
+  int64_t modified_seconds_;
+  int64_t modified_nanoseconds_;
+} CacheFile;
+
+int loadStoryCache(char *, Pack *, int *);
+
+int isCacheFileUnchanged(char *, CacheFile *);
+
+void getCachePath(char *, char **, int *);
+
+//-----------------------------------------------------------------------------
+///
+/// Plays the story of the start file from its cache, if the cache exists and
+/// none of the chapter files changed since it was written. Nothing is read
+/// or analyzed then, the chapter files are only examined with stat.
+///
+/// Sets error to the error of playing, e.g. ERR_IO, or to ERR_OUT_OF_MEMORY.
+///
+/// @param arguments The parsed command line arguments.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return 1 if the story was played from the cache, 0 if it has to be
+/// loaded.
+//
+int playCachedStory(Arguments *arguments, int *error)
+{
+  if (!arguments->use_cache_)
+  {
+    return 0;
+  }
+
+  Pack pack;
+  startPhase();
+  int is_cached = loadStoryCache(arguments->start_file_, &pack, error);
+  finishPhase(PHASE_LOAD);
+  if (is_cached)
+  {
+    printGraphClass(pack.graph_class_);
+    playStory(pack.chapters_, NULL, arguments, error);
+    finishPhase(PHASE_PLAY);
+    startPhase();
+    freePack(&pack);
+    finishPhase(PHASE_TEARDOWN);
+  }
+  return is_cached;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Maps the cache of start_file and creates the Chapters of its pack, if the
+/// cache is valid and all of its files are unchanged. A missing, invalid or
+/// outdated cache is no error.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param start_file The path of the first chapter file.
+/// @param pack A pointer to the Pack which will be filled.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return 1 if pack was loaded from the cache, else 0 and pack is freed.
+//
+int loadStoryCache(char *start_file, Pack *pack, int *error)
+{
+  char *cache_path = NULL;
+  getCachePath(start_file, &cache_path, error);
+  if (*error)
+  {
+    return 0;
+  }
+  int cache_error = 0;
+  pack->chapters_ = NULL;
+  mapChapterText(cache_path, &pack->mapping_, &pack->mapping_length_,
+                 &cache_error);
+  free(cache_path);
+
+  CacheHeader *header = (CacheHeader *) pack->mapping_;
+  size_t length = pack->mapping_length_;
+  int is_valid = pack->mapping_ != NULL
+      && length >= sizeof(CacheHeader)
+      && memcmp(header->magic_, CACHE_MAGIC, sizeof(header->magic_)) == 0
+      && header->version_ == CACHE_VERSION
+      && header->file_count_ > 0
+      && (length - sizeof(CacheHeader)) / sizeof(CacheFile) >=
+         header->file_count_;
+  size_t paths_offset = 0;
+  if (is_valid)
+  {
+    paths_offset = sizeof(CacheHeader) +
+                   header->file_count_ * sizeof(CacheFile);
+    is_valid = header->paths_length_ > 0
+               && header->paths_length_ <= length - paths_offset
+               && pack->mapping_[paths_offset + header->paths_length_ - 1] ==
+                  '\0'
+               && header->pack_offset_ >= paths_offset + header->paths_length_
+               && header->pack_offset_ % sizeof(uint64_t) == 0
+               && header->pack_offset_ <= length;
+  }
+
+  // Every path is checked, so a changed alias of a file is noticed too
+  CacheFile *cache_files = (CacheFile *) (header + 1);
+  char *paths = pack->mapping_ + paths_offset;
+  for (size_t index = 0; is_valid && index < header->file_count_; index++)
+  {
+    is_valid = cache_files[index].path_offset_ < header->paths_length_
+               && isCacheFileUnchanged(paths +
+                                       cache_files[index].path_offset_,
+                                       cache_files + index);
+  }
+  if (is_valid)
+  {
+    readPack(pack->mapping_ + header->pack_offset_,
+             length - header->pack_offset_, pack, &cache_error);
+    is_valid = !cache_error;
+  }
+  if (!is_valid)
+  {
+    if (cache_error == ERR_OUT_OF_MEMORY)
+    {
+      *error = cache_error;
+    }
+    freePack(pack);
+  }
+  return is_valid;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Checks if the file behind path is still the one recorded in cache_file.
+///
+/// @param path The NUL terminated path of the file.
+/// @param cache_file The recorded state of the file.
+///
+/// @return 1 if device, inode, size and modification time are unchanged,
+/// else 0.
+//
+int isCacheFileUnchanged(char *path, CacheFile *cache_file)
+{
+  FileIdentity file_identity = getFileIdentity(path);
+  return file_identity.is_valid_
+         && (uint64_t) file_identity.device_ == cache_file->device_
+         && (uint64_t) file_identity.inode_ == cache_file->inode_
+         && (uint64_t) file_identity.size_ == cache_file->size_
+         && (int64_t) file_identity.modified_.tv_sec ==
+            cache_file->modified_seconds_
+         && (int64_t) file_identity.modified_.tv_nsec ==
+            cache_file->modified_nanoseconds_;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Writes the loaded and analyzed story of map into the cache of start_file,
+/// together with the state of every chapter file. The cache is written into
+/// a temporary file and renamed, so other runs never see a partial cache.
+/// Like a normal file it is readable by other users, if the umask allows it.
+/// Nothing is written if a file was modified shortly before loading, because
+/// a later change in the same second could go unnoticed. Failures are
+/// ignored, the story is just loaded normally next time.
+///
+/// @param map The map containing the analyzed story.
+/// @param graph_class The GraphClass of the story.
+/// @param start_file The path of the first chapter file.
+/// @param load_start The time at which loading the story started.
+/// @param error The error pointer, the cache is only written if it is not
+/// set. It is never set by this function.
+///
+/// @return nothing
+//
+void writeStoryCache(Map *map, GraphClass graph_class, char *start_file,
+                     time_t load_start, int *error)
+{
+  if (*error || map->count_ == 0 || map->count_ > UINT32_MAX)
+  {
+    return;
+  }
+
+  uint64_t paths_length = 0;
+  for (MapEntry *entry = map->start_entry_;
+       entry < map->start_entry_ + map->count_;
+       entry++)
+  {
+    if (!entry->file_identity_.is_valid_ ||
+        entry->file_identity_.modified_.tv_sec + CACHE_RACY_SECONDS >
+        load_start)
+    {
+      return;
+    }
+    paths_length += entry->key_length_ + 1;
+  }
+
+  int cache_error = 0;
+  char *cache_path = NULL;
+  getCachePath(start_file, &cache_path, &cache_error);
+  CacheFile *cache_files = (CacheFile *) calloc(map->count_,
+                                                sizeof(CacheFile));
+  char *temporary_path = cache_path ? (char *) malloc(
+      strlen(cache_path) + strlen(CACHE_TEMPORARY_SUFFIX) + 1) : NULL;
+  if (cache_files == NULL || temporary_path == NULL)
+  {
+    free(cache_path);
+    free(cache_files);
+    free(temporary_path);
+    return;
+  }
+
+  uint64_t path_offset = 0;
+  for (size_t index = 0; index < map->count_; index++)
+  {
+    MapEntry *entry = map->start_entry_ + index;
+    cache_files[index].path_offset_ = path_offset;
+    cache_files[index].device_ = (uint64_t) entry->file_identity_.device_;
+    cache_files[index].inode_ = (uint64_t) entry->file_identity_.inode_;
+    cache_files[index].size_ = (uint64_t) entry->file_identity_.size_;
+    cache_files[index].modified_seconds_ =
+        (int64_t) entry->file_identity_.modified_.tv_sec;
+    cache_files[index].modified_nanoseconds_ =
+        (int64_t) entry->file_identity_.modified_.tv_nsec;
+    path_offset += entry->key_length_ + 1;
+  }
+
+  CacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic_, CACHE_MAGIC, sizeof(header.magic_));
+  header.version_ = CACHE_VERSION;
+  header.file_count_ = (uint32_t) map->count_;
+  header.paths_length_ = paths_length;
+  uint64_t paths_end = sizeof(header) + map->count_ * sizeof(CacheFile) +
+                       paths_length;
+  header.pack_offset_ = (paths_end + sizeof(uint64_t) - 1) &
+                        ~(uint64_t) (sizeof(uint64_t) - 1);
+  char padding[sizeof(uint64_t)] = {0};
+
+  strcpy(temporary_path, cache_path);
+  strcat(temporary_path, CACHE_TEMPORARY_SUFFIX);
+  int file_descriptor = mkstemp(temporary_path);
+  if (file_descriptor >= 0)
+  {
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(file_descriptor, CACHE_FILE_MODE & ~mask);
+  }
+  FILE *file = file_descriptor >= 0 ? fdopen(file_descriptor, "wb") : NULL;
+  if (file == NULL && file_descriptor >= 0)
+  {
+    close(file_descriptor);
+  }
+  int written = file != NULL
+      && fwrite(&header, sizeof(header), 1, file) == 1
+      && fwrite(cache_files, sizeof(CacheFile), map->count_, file) ==
+         map->count_;
+  for (MapEntry *entry = map->start_entry_;
+       written && entry < map->start_entry_ + map->count_;
+       entry++)
+  {
+    written = fwrite(entry->key_, 1, entry->key_length_, file) ==
+              entry->key_length_
+              && fputc('\0', file) != EOF;
+  }
+  written = written
+      && fwrite(padding, 1, header.pack_offset_ - paths_end, file) ==
+         header.pack_offset_ - paths_end
+      && writePackData(map, graph_class, file, &cache_error);
+  if (file != NULL && fclose(file) != 0)
+  {
+    written = 0;
+  }
+  if (file_descriptor >= 0 &&
+      (!written || rename(temporary_path, cache_path) != 0))
+  {
+    remove(temporary_path);
+  }
+  free(cache_path);
+  free(cache_files);
+  free(temporary_path);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Creates the path of the cache of start_file, which lies next to it.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param start_file The path of the first chapter file.
+/// @param cache_path A pointer to the path, which has to be freed.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void getCachePath(char *start_file, char **cache_path, int *error)
+{
+  *cache_path = (char *) malloc(strlen(start_file) +
+                                strlen(CACHE_SUFFIX) + 1);
+  if (*cache_path == NULL)
+  {
+    *error = ERR_OUT_OF_MEMORY;
+    return;
+  }
+  strcpy(*cache_path, start_file);
+  strcat(*cache_path, CACHE_SUFFIX);
+}
+
+/**
+ *
+ * Replay functions
+ *
+ */
+
+void startReplaySession(ReplaySession *, Chapter *, int);
+
+void replayChoice(ReplaySession *, char, int);
+
+void finishReplaySession(ReplaySession *, size_t);
+
+//-----------------------------------------------------------------------------
+///
+/// Replays many recorded sessions against the loaded story. Every line of
+/// replay_file is one session which starts at start_chapter, every character
+/// of it is one choice: 'A' and 'B' select an option, every other character
+/// is an invalid input. Choices after an end Chapter are ignored.
+/// The file is read in blocks, so sessions may be arbitrarily long.
+///
+/// For every session a line with its number, "ENDE" or "OFFEN", its number
+/// of turns and invalid inputs and the title of its final Chapter, separated
+/// by tabs, is printed. Unless REPLAY_QUIET is set, the Chapters and error
+/// messages are printed before it, as when playing interactively.
+///
+/// Sets error to ERR_IO, if the replay file can't be read.
+///
+/// @param start_chapter The Chapter with which every session starts.
+/// @param replay_file The path of the file with the sessions.
+/// @param replay_flags The REPLAY_* flags.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void replaySessions(Chapter *start_chapter, char *replay_file,
+                    int replay_flags, int *error)
+{
+  FILE *file = fopen(replay_file, "rb");
+  char *buffer = NULL;
+  if (file)
+  {
+    buffer = malloc(REPLAY_BUFFER_SIZE);
+  }
+  if (buffer == NULL)
+  {
+    *error = file ? ERR_OUT_OF_MEMORY : ERR_IO;
+    printError(*error, replay_file);
+    if (file)
+    {
+      fclose(file);
+    }
+    return;
+  }
+
+  ReplaySession session;
+  size_t session_count = 0;
+  int in_session = 0;
+  size_t read_length;
+  while ((read_length = fread(buffer, 1, REPLAY_BUFFER_SIZE, file)) > 0)
+  {
+    for (size_t index = 0; index < read_length; index++)
+    {
+      if (!in_session)
+      {
+        startReplaySession(&session, start_chapter, replay_flags);
+        in_session = 1;
+      }
+      if (buffer[index] == '\n')
+      {
+        finishReplaySession(&session, ++session_count);
+        in_session = 0;
+        continue;
+      }
+      replayChoice(&session, buffer[index], replay_flags);
+    }
+  }
+  if (in_session)
+  {
+    finishReplaySession(&session, ++session_count);
+  }
+
+  if (ferror(file))
+  {
+    *error = ERR_IO;
+    printError(*error, replay_file);
+  }
+  free(buffer);
+  fclose(file);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Starts a new session at start_chapter.
+///
+/// @param session The ReplaySession that should be started.
+/// @param start_chapter The Chapter with which the session starts.
+/// @param replay_flags The REPLAY_* flags.
+///
+/// @return nothing
+//
+void startReplaySession(ReplaySession *session, Chapter *start_chapter,
+                        int replay_flags)
+{
+  session->chapter_ = start_chapter;
+  session->turn_count_ = 0;
+  session->invalid_count_ = 0;
+  if (!(replay_flags & REPLAY_QUIET))
+  {
+    writeChapterFrame(start_chapter);
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Applies a single choice to session, like getChoice and playChapter would
+/// for an input line consisting of choice.
+///
+/// @param session The ReplaySession that should be advanced.
+/// @param choice The character of the choice.
+/// @param replay_flags The REPLAY_* flags.
+///
+/// @return nothing
+//
+void replayChoice(ReplaySession *session, char choice, int replay_flags)
+{
+  Chapter *chapter = session->chapter_;
+  if (chapter->options_[0] == NULL)
+  {
+    return;
+  }
+  if (choice != 'A' && choice != 'B')
+  {
+    session->invalid_count_++;
+    if (!(replay_flags & REPLAY_QUIET))
+    {
+      printf(FRAME_INVALID_CHOICE);
+    }
+    return;
+  }
+
+  session->chapter_ = chapter->options_[choice - 'A'];
+  session->turn_count_++;
+  if (!(replay_flags & REPLAY_QUIET))
+  {
+    writeChapterFrame(session->chapter_);
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Prints the result line of a finished session.
+///
+/// @param session The ReplaySession that is finished.
+/// @param session_number The number of the session, starting at 1.
+///
+/// @return nothing
+//
+void finishReplaySession(ReplaySession *session, size_t session_number)
+{
+  Chapter *chapter = session->chapter_;
+  printf("%zu\t%s\t%zu\t%zu\t%.*s\n", session_number,
+         chapter->options_[0] ? "OFFEN" : "ENDE", session->turn_count_,
+         session->invalid_count_, (int) chapter->title_length_,
+         getChapterTitle(chapter));
+}
+
+/**
+ *
+ * Server functions
+ *
+ */
+
+void openServerSocket(Server *, char *, int *);
+
+void runServer(Server *);
+
+void stopServer(int);
+
+void closeServer(Server *, char *);
+
+void acceptSessions(Server *);
+
+void serviceSession(Server *, int);
+
+int readSessionInput(int, ServerSession *);
+
+int writeSessionOutput(int, ServerSession *);
+
+void watchSession(Server *, int, int);
+
+void closeSession(Server *, int);
+
+// Set by stopServer, when the server should shut down
+static volatile sig_atomic_t server_stopped = 0;
+
+//-----------------------------------------------------------------------------
+///
+/// Serves the story to many players at once on a Unix domain socket, until
+/// SIGINT or SIGTERM is received. Every connection is one session, which
+/// reads choice lines and gets the same output as an interactive player.
+/// The story is loaded and analyzed once and shared by all sessions, which
+/// are driven by a single epoll event loop. If watched_map is given, its
+/// changed chapter files are reloaded by the same loop.
+///
+/// Sets error to ERR_SERVE, if the socket can't be opened.
+///
+/// @param start_chapter The Chapter with which every session starts.
+/// @param watched_map The Map whose files should be watched or NULL.
+/// @param socket_file The path of the socket.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void serveStory(Chapter *start_chapter, Map *watched_map, char *socket_file,
+                int *error)
+{
+  Server server = {
+      .listen_fd_ = -1,
+      .epoll_fd_ = -1,
+      .start_chapter_ = start_chapter,
+      .sessions_ = NULL,
+      .session_length_ = 0,
+      .watcher_ = NULL
+  };
+  Watcher watcher;
+  openServerSocket(&server, socket_file, error);
+  if (!*error && watched_map)
+  {
+    startWatcher(&watcher, watched_map, server.epoll_fd_, error);
+    server.watcher_ = *error ? NULL : &watcher;
+    if (*error)
+    {
+      printError(*error, socket_file);
+    }
+  }
+  if (!*error)
+  {
+    struct sigaction action = {.sa_handler = stopServer};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    runServer(&server);
+  }
+  if (server.watcher_)
+  {
+    stopWatcher(server.watcher_);
+  }
+  closeServer(&server, socket_file);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Creates the listening socket and the epoll instance of server. A stale
+/// socket at socket_file is replaced, other files are not.
+///
+/// Sets error to ERR_SERVE, if the socket can't be opened.
+///
+/// @param server The Server that should be opened.
+/// @param socket_file The path of the socket.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void openServerSocket(Server *server, char *socket_file, int *error)
+{
+  struct sockaddr_un address = {.sun_family = AF_UNIX};
+  if (strlen(socket_file) >= sizeof(address.sun_path))
+  {
+    *error = ERR_SERVE;
+    printError(*error, socket_file);
+    return;
+  }
+  strcpy(address.sun_path, socket_file);
+
+  struct stat file_stat;
+  if (lstat(socket_file, &file_stat) == 0 && S_ISSOCK(file_stat.st_mode))
+  {
+    unlink(socket_file);
+  }
+
+  server->listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK |
+                                       SOCK_CLOEXEC, 0);
+  if (server->listen_fd_ < 0 ||
+      bind(server->listen_fd_, (struct sockaddr *) &address,
+           sizeof(address)) != 0)
+  {
+    if (server->listen_fd_ >= 0)
+    {
+      close(server->listen_fd_);
+      server->listen_fd_ = -1;
+    }
+    *error = ERR_SERVE;
+    printError(*error, socket_file);
+    return;
+  }
+
+  server->epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event = {
+      .events = EPOLLIN,
+      .data.fd = server->listen_fd_
+  };
+  if (listen(server->listen_fd_, SOMAXCONN) != 0 || server->epoll_fd_ < 0 ||
+      epoll_ctl(server->epoll_fd_, EPOLL_CTL_ADD, server->listen_fd_,
+                &event) != 0)
+  {
+    *error = ERR_SERVE;
+    printError(*error, socket_file);
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Runs the event loop of server until it is stopped.
+///
+/// @param server The opened Server.
+///
+/// @return nothing
+//
+void runServer(Server *server)
+{
+  struct epoll_event events[SERVER_EVENT_COUNT];
+  while (!server_stopped)
+  {
+    int event_count = epoll_wait(server->epoll_fd_, events,
+                                 SERVER_EVENT_COUNT, -1);
+    if (event_count < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      return;
+    }
+
+    for (int index = 0; index < event_count; index++)
+    {
+      if (events[index].data.fd == server->listen_fd_)
+      {
+        acceptSessions(server);
+      }
+      else if (server->watcher_ &&
+               events[index].data.fd == server->watcher_->inotify_fd_)
+      {
+        handleWatchEvents(server->watcher_);
+        server->start_chapter_ = server->watcher_->map_->start_entry_->value_;
+      }
+      else
+      {
+        serviceSession(server, events[index].data.fd);
+      }
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// The signal handler, which makes runServer return.
+///
+/// @param signal_number The received signal.
+///
+/// @return nothing
+//
+void stopServer(int signal_number)
+{
+  (void) signal_number;
+  server_stopped = 1;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Closes all sessions and the sockets of server and removes its socket file.
+///
+/// @param server The Server that should be closed.
+/// @param socket_file The path of the socket.
+///
+/// @return nothing
+//
+void closeServer(Server *server, char *socket_file)
+{
+  for (size_t fd = 0; fd < server->session_length_; fd++)
+  {
+    if (server->sessions_[fd].chapter_)
+    {
+      close((int) fd);
+    }
+  }
+  free(server->sessions_);
+  if (server->epoll_fd_ >= 0)
+  {
+    close(server->epoll_fd_);
+  }
+  if (server->listen_fd_ >= 0)
+  {
+    close(server->listen_fd_);
+    unlink(socket_file);
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Accepts all pending connections of server and starts a session for each,
+/// by sending the frame of the start Chapter. Connections for which no
+/// session can be allocated are closed.
+///
+/// @param server The Server whose connections should be accepted.
+///
+/// @return nothing
+//
+void acceptSessions(Server *server)
+{
+  int fd;
+  while ((fd = accept4(server->listen_fd_, NULL, NULL,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+  {
+    if ((size_t) fd >= server->session_length_)
+    {
+      size_t length = server->session_length_;
+      while ((size_t) fd >= length)
+      {
+        length += SESSION_MALLOC_INTERVALL;
+      }
+      ServerSession *sessions = realloc(server->sessions_,
+                                        length * sizeof(ServerSession));
+      if (sessions == NULL)
+      {
+        close(fd);
+        continue;
+      }
+      memset(sessions + server->session_length_, 0,
+             (length - server->session_length_) * sizeof(ServerSession));
+      server->sessions_ = sessions;
+      server->session_length_ = length;
+    }
+
+    struct epoll_event event = {
+        .events = EPOLLIN,
+        .data.fd = fd
+    };
+    if (epoll_ctl(server->epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0)
+    {
+      close(fd);
+      continue;
+    }
+    server->sessions_[fd] = (ServerSession) {
+        .chapter_ = server->start_chapter_,
+        .output_offset_ = 0,
+        .output_ = OUTPUT_FRAME,
+        .choice_state_ = CHOICE_BEGIN,
+        .watches_output_ = 0
+    };
+    serviceSession(server, fd);
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Advances the session of fd as far as possible without blocking: sends
+/// its pending output, or otherwise reads one block of input. The session is
+/// closed when its story ended, the player disconnected or an error occurred.
+///
+/// @param server The Server of the session.
+/// @param fd The file descriptor of the session.
+///
+/// @return nothing
+//
+void serviceSession(Server *server, int fd)
+{
+  ServerSession *session = server->sessions_ + fd;
+  if (session->chapter_ == NULL)
+  {
+    return;
+  }
+  int result = 1;
+  if (session->output_ == OUTPUT_NONE)
+  {
+    result = readSessionInput(fd, session);
+  }
+  if (result > 0 && session->output_ != OUTPUT_NONE)
+  {
+    result = writeSessionOutput(fd, session);
+  }
+  if (result >= 0 && session->output_ == OUTPUT_NONE &&
+      session->chapter_->options_[0] == NULL)
+  {
+    // Discard the unread input, so the player gets the end of the story
+    // instead of a connection reset
+    char input[SERVER_INPUT_SIZE];
+    while (recv(fd, input, sizeof(input), 0) == (ssize_t) sizeof(input))
+    {
+    }
+    result = -1;
+  }
+
+  if (result < 0)
+  {
+    closeSession(server, fd);
+    return;
+  }
+  watchSession(server, fd, session->output_ != OUTPUT_NONE);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Processes the input of a session up to the first line which produces
+/// output. The input is peeked first, so only the processed part is removed
+/// from the socket and the rest waits there until the output was sent.
+///
+/// @param fd The file descriptor of the session.
+/// @param session The ServerSession without pending output.
+///
+/// @return 1 if input was processed, 0 if there is none and -1 if the
+/// player disconnected or an error occurred.
+//
+int readSessionInput(int fd, ServerSession *session)
+{
+  char input[SERVER_INPUT_SIZE];
+  ssize_t input_length = recv(fd, input, sizeof(input), MSG_PEEK);
+  if (input_length <= 0)
+  {
+    return (input_length < 0 && (errno == EAGAIN || errno == EINTR)) ? 0 : -1;
+  }
+
+  ssize_t index = 0;
+  while (index < input_length && session->output_ == OUTPUT_NONE)
+  {
+    ChoiceState state = (ChoiceState) session->choice_state_;
+    if (input[index++] != '\n')
+    {
+      session->choice_state_ = readChoiceCharacter(state, input[index - 1]);
+      continue;
+    }
+
+    session->choice_state_ = CHOICE_BEGIN;
+    if (state < 0)
+    {
+      session->output_ = OUTPUT_ERROR;
+    }
+    else
+    {
+      session->chapter_ = session->chapter_->options_[state];
+      session->output_ = OUTPUT_FRAME;
+    }
+  }
+  return recv(fd, input, (size_t) index, 0) == index ? 1 : -1;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Sends the pending output of a session, continuing at its output offset.
+///
+/// @param fd The file descriptor of the session.
+/// @param session The ServerSession with pending output.
+///
+/// @return 1 if the output was sent, 0 if the socket is full and -1 if an
+/// error occurred.
+//
+int writeSessionOutput(int fd, ServerSession *session)
+{
+  struct iovec pieces[6];
+  int piece_count = 1;
+  if (session->output_ == OUTPUT_ERROR)
+  {
+    pieces[0] = (struct iovec) {FRAME_INVALID_CHOICE,
+                                strlen(FRAME_INVALID_CHOICE)};
+  }
+  else
+  {
+    piece_count = getChapterFramePieces(session->chapter_, pieces);
+  }
+
+  while (1)
+  {
+    // Skip what was already sent
+    struct iovec *piece = pieces;
+    int remaining_count = piece_count;
+    size_t offset = session->output_offset_;
+    while (remaining_count && offset >= piece->iov_len)
+    {
+      offset -= piece->iov_len;
+      piece++;
+      remaining_count--;
+    }
+    if (remaining_count == 0)
+    {
+      session->output_ = OUTPUT_NONE;
+      session->output_offset_ = 0;
+      return 1;
+    }
+    struct iovec first_piece = *piece;
+    piece->iov_base = (char *) piece->iov_base + offset;
+    piece->iov_len -= offset;
+
+    struct msghdr message = {
+        .msg_iov = piece,
+        .msg_iovlen = (size_t) remaining_count
+    };
+    ssize_t sent_length = sendmsg(fd, &message, MSG_NOSIGNAL);
+    *piece = first_piece;
+    if (sent_length < 0)
+    {
+      return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    session->output_offset_ += (size_t) sent_length;
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Makes the event loop wait for a session to become writable or readable.
+///
+/// @param server The Server of the session.
+/// @param fd The file descriptor of the session.
+/// @param watch_output If the session waits to send its output.
+///
+/// @return nothing
+//
+void watchSession(Server *server, int fd, int watch_output)
+{
+  ServerSession *session = server->sessions_ + fd;
+  if (session->watches_output_ == watch_output)
+  {
+    return;
+  }
+  struct epoll_event event = {
+      .events = watch_output ? EPOLLOUT : EPOLLIN,
+      .data.fd = fd
+  };
+  if (epoll_ctl(server->epoll_fd_, EPOLL_CTL_MOD, fd, &event) != 0)
+  {
+    closeSession(server, fd);
+    return;
+  }
+  session->watches_output_ = (int8_t) watch_output;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Ends a session and closes its connection.
+///
+/// @param server The Server of the session.
+/// @param fd The file descriptor of the session.
+///
+/// @return nothing
+//
+void closeSession(Server *server, int fd)
+{
+  server->sessions_[fd].chapter_ = NULL;
+  close(fd);
+}
+
+/**
+ *
+ * Watch functions
+ *
+ */
+
+void addEntryWatches(Watcher *, int *);
+
+int isWatchedFile(Watcher *, size_t, int, char *, size_t);
+
+int isChangedEntry(Watcher *, size_t, int, char *, size_t, FileIdentity);
+
+void reloadWatchedFile(Watcher *, int, char *);
+
+void undoChapterSplit(Map *, Chapter *, Chapter *, size_t, size_t);
+
+void removeNewEntries(Map *, size_t);
+
+void addGraphParent(Chapter *, Chapter *, int *);
+
+void removeGraphParent(Chapter *, Chapter *);
+
+void linkChapterOptions(Chapter *, int *);
+
+int relinkParentOptions(Map *, Chapter *, int *);
+
+void reanalyzeChapters(Watcher *, Chapter **, size_t, size_t, int *);
+
+GraphClass getWatchedGraphClass(Watcher *, int *);
+
+//-----------------------------------------------------------------------------
+///
+/// Starts watching the directories of all chapter files of map with inotify
+/// and links every Chapter to its parents, so changes can be analyzed
+/// incrementally. The inotify descriptor is added to the epoll instance of
+/// the server.
+///
+/// Sets error to ERR_SERVE if inotify can't be used, ERR_OUT_OF_MEMORY if
+/// allocation fails.
+///
+/// @param watcher The Watcher that should be started.
+/// @param map The loaded and analyzed Map whose files should be watched.
+/// @param epoll_fd The epoll instance which will wait for changes.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void startWatcher(Watcher *watcher, Map *map, int epoll_fd, int *error)
+{
+  watcher->map_ = map;
+  watcher->entry_watches_ = NULL;
+  watcher->entry_watch_count_ = 0;
+  watcher->dead_end_count_ = 0;
+  watcher->search_mark_ = 0;
+  watcher->inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  struct epoll_event event = {
+      .events = EPOLLIN,
+      .data.fd = watcher->inotify_fd_
+  };
+  if (watcher->inotify_fd_ < 0 ||
+      epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watcher->inotify_fd_, &event) != 0)
+  {
+    *error = ERR_SERVE;
+    stopWatcher(watcher);
+    return;
+  }
+
+  addEntryWatches(watcher, error);
+  for (MapEntry *entry = map->start_entry_;
+       entry < map->start_entry_ + map->count_ && !*error;
+       entry++)
+  {
+    if (entry->owns_value_)
+    {
+      linkChapterOptions(entry->value_, error);
+      watcher->dead_end_count_ +=
+          entry->value_->graph_analyze_state_ == DEAD_END;
+    }
+  }
+  watcher->graph_class_ = getWatchedGraphClass(watcher, error);
+  if (*error)
+  {
+    stopWatcher(watcher);
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Stops watching the files. The parent lists of the Chapters are freed with
+/// the Map.
+///
+/// @param watcher The Watcher that should be stopped.
+///
+/// @return nothing
+//
+void stopWatcher(Watcher *watcher)
+{
+  if (watcher->inotify_fd_ >= 0)
+  {
+    close(watcher->inotify_fd_);
+  }
+  free(watcher->entry_watches_);
+  watcher->inotify_fd_ = -1;
+  watcher->entry_watches_ = NULL;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Watches the directories of the map entries added since the last call.
+/// Directories are watched instead of the files, so files replaced by a
+/// rename, as most editors save them, are noticed too.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param watcher The Watcher of the map.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void addEntryWatches(Watcher *watcher, int *error)
+{
+  Map *map = watcher->map_;
+  if (*error || map->count_ <= watcher->entry_watch_count_)
+  {
+    return;
+  }
+  int *entry_watches = (int *) realloc(watcher->entry_watches_,
+                                       map->count_ * sizeof(int));
+  if (entry_watches == NULL)
+  {
+    *error = ERR_OUT_OF_MEMORY;
+    return;
+  }
+  watcher->entry_watches_ = entry_watches;
+
+  for (size_t index = watcher->entry_watch_count_; index < map->count_;
+       index++)
+  {
+    MapEntry *entry = map->start_entry_ + index;
+    char *slash = memrchr(entry->key_, '/', entry->key_length_);
+    StringView directory = {
+        .start_ = slash ? entry->key_ : ".",
+        .length_ = slash ? (size_t) (slash - entry->key_) : 1
+    };
+    if (slash == entry->key_)
+    {
+      directory.length_ = 1;
+    }
+    char *path = NULL;
+    copyStringView(directory, &path, error);
+    if (*error)
+    {
+      return;
+    }
+    watcher->entry_watches_[index] = inotify_add_watch(
+        watcher->inotify_fd_, path, IN_CLOSE_WRITE | IN_MOVED_TO);
+    free(path);
+    watcher->entry_watch_count_ = index + 1;
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Checks if the map entry with entry_index is the file name in the
+/// directory with watch.
+///
+/// @param watcher The Watcher of the map.
+/// @param entry_index The position of the entry in the map.
+/// @param watch The watch descriptor of the directory.
+/// @param name The name of the file in the directory.
+/// @param name_length The length of name.
+///
+/// @return 1 if the entry is the file, else 0.
+//
+int isWatchedFile(Watcher *watcher, size_t entry_index, int watch, char *name,
+                  size_t name_length)
+{
+  if (entry_index >= watcher->entry_watch_count_ ||
+      watcher->entry_watches_[entry_index] != watch)
+  {
+    return 0;
+  }
+  MapEntry *entry = watcher->map_->start_entry_ + entry_index;
+  char *slash = memrchr(entry->key_, '/', entry->key_length_);
+  char *base_name = slash ? slash + 1 : entry->key_;
+  size_t base_length = (size_t) (entry->key_ + entry->key_length_ - base_name);
+  return base_length == name_length &&
+         memcmp(base_name, name, name_length) == 0;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Checks if the map entry with entry_index refers to the changed file, by
+/// its name or by the FileIdentity the file had before the change.
+///
+/// @param watcher The Watcher of the map.
+/// @param entry_index The position of the entry in the map.
+/// @param watch The watch descriptor of the directory.
+/// @param name The name of the file in the directory.
+/// @param name_length The length of name.
+/// @param old_identity The FileIdentity of the file before the change.
+///
+/// @return 1 if the entry refers to the file, else 0.
+//
+int isChangedEntry(Watcher *watcher, size_t entry_index, int watch,
+                   char *name, size_t name_length, FileIdentity old_identity)
+{
+  FileIdentity identity =
+      watcher->map_->start_entry_[entry_index].file_identity_;
+  return isWatchedFile(watcher, entry_index, watch, name, name_length) ||
+         (old_identity.is_valid_ && identity.is_valid_ &&
+          identity.device_ == old_identity.device_ &&
+          identity.inode_ == old_identity.inode_);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Reads the pending inotify events and reloads every changed chapter file.
+///
+/// @param watcher The Watcher whose events should be handled.
+///
+/// @return nothing
+//
+void handleWatchEvents(Watcher *watcher)
+{
+  char buffer[WATCH_BUFFER_SIZE]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t length;
+  while ((length = read(watcher->inotify_fd_, buffer, sizeof(buffer))) > 0)
+  {
+    char *position = buffer;
+    while (position < buffer + length)
+    {
+      struct inotify_event *event = (struct inotify_event *) position;
+      if (event->len && (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)))
+      {
+        reloadWatchedFile(watcher, event->wd, event->name);
+      }
+      position += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  fflush(stdout);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Reloads the chapter file name in the directory with watch and patches its
+/// Chapter in place, so running sessions see the change. Newly referenced
+/// files are loaded, and only the changed Chapter and its ancestors are
+/// analyzed again.
+/// If the Chapter is shared with a copy in another file, the changed file
+/// gets a Chapter of its own and the parents are linked again.
+/// The change is only applied if the file and all new files can be loaded,
+/// otherwise the error is printed and the story stays as it is. Replaced
+/// contents stay allocated, because keys of the map may point into them.
+///
+/// @param watcher The Watcher of the map.
+/// @param watch The watch descriptor of the directory.
+/// @param name The name of the changed file in the directory.
+///
+/// @return nothing
+//
+void reloadWatchedFile(Watcher *watcher, int watch, char *name)
+{
+  Map *map = watcher->map_;
+  size_t name_length = strlen(name);
+  size_t changed_index = 0;
+  while (changed_index < map->count_ &&
+         !isWatchedFile(watcher, changed_index, watch, name, name_length))
+  {
+    changed_index++;
+  }
+  if (changed_index == map->count_)
+  {
+    return;
+  }
+
+  int error = 0;
+  MapEntry *changed_entry = map->start_entry_ + changed_index;
+  Chapter *chapter = changed_entry->value_;
+  StringView filename = {changed_entry->key_, changed_entry->key_length_};
+  char *path = NULL;
+  copyStringView(filename, &path, &error);
+  char *content = NULL;
+  size_t content_length = 0;
+  int is_mapped = 0;
+  loadChapterText(path, map->load_flags_, &map->text_arena_, &content,
+                  &content_length, &is_mapped, &error);
+  unsigned long long content_hash = 0;
+  StringView title;
+  StringView text;
+  StringView option_files[OPTION_COUNT];
+  getChapterPropertiesFromText(content, content_length, &title, &text,
+                               option_files, &content_hash, &error);
+  validateOptions(option_files, &error);
+  if (error || (content_length == chapter->content_length_ &&
+                memcmp(content, chapter->content_, content_length) == 0))
+  {
+    if (is_mapped)
+    {
+      munmap(content, content_length);
+    }
+    printError(error, path);
+    free(path);
+    return;
+  }
+
+  // Entries of the same file share its FileIdentity, other entries of the
+  // Chapter are copies which keep the old content
+  FileIdentity old_identity = changed_entry->file_identity_;
+  size_t owner_index = map->count_;
+  size_t copy_index = map->count_;
+  for (size_t index = 0; index < map->count_; index++)
+  {
+    MapEntry *entry = map->start_entry_ + index;
+    if (entry->value_ == chapter && entry->owns_value_)
+    {
+      owner_index = index;
+    }
+    if (entry->value_ == chapter && copy_index == map->count_ &&
+        !isChangedEntry(watcher, index, watch, name, name_length,
+                        old_identity))
+    {
+      copy_index = index;
+    }
+  }
+
+  Chapter *target = chapter;
+  if (copy_index < map->count_)
+  {
+    createChapter(&map->chapter_arena_, &target, &error);
+    for (size_t index = 0; index < map->count_ && !error; index++)
+    {
+      MapEntry *entry = map->start_entry_ + index;
+      if (entry->value_ == chapter &&
+          isChangedEntry(watcher, index, watch, name, name_length,
+                         old_identity))
+      {
+        entry->value_ = target;
+        entry->owns_value_ = 0;
+      }
+    }
+    // The copies need a new owner, if the old one is an entry of the file
+    if (!error)
+    {
+      changed_entry->owns_value_ = 1;
+      if (map->start_entry_[owner_index].value_ != chapter)
+      {
+        map->start_entry_[copy_index].owns_value_ = 1;
+      }
+    }
+  }
+
+  // Load the new options into a scratch Chapter, so nothing is changed if a
+  // file can't be loaded
+  size_t first_new_entry = map->count_;
+  Chapter staged;
+  memset(&staged, 0, sizeof(staged));
+  Worklist worklist = {
+      .length_ = 0,
+      .count_ = 0,
+      .start_option_ = NULL
+  };
+  queueOptions(&staged, option_files, &worklist, &error);
+  loadPendingOptions(&worklist, map, &error);
+  free(worklist.start_option_);
+  if (error)
+  {
+    removeNewEntries(map, first_new_entry);
+    if (target != chapter)
+    {
+      undoChapterSplit(map, chapter, target, owner_index, copy_index);
+    }
+    if (is_mapped)
+    {
+      munmap(content, content_length);
+    }
+    if (error != ERR_IO)
+    {
+      printError(error, path);
+    }
+    createMapBuckets(map, map->bucket_count_, &error);
+    free(path);
+    return;
+  }
+
+  // Apply the change and update the parent links
+  if (target == chapter)
+  {
+    for (int option_index = 0; option_index < OPTION_COUNT; option_index++)
+    {
+      removeGraphParent(chapter->options_[option_index], chapter);
+    }
+  }
+  target->content_ = content;
+  target->content_length_ = content_length;
+  target->is_mapped_ = is_mapped;
+  target->content_hash_ = content_hash;
+  target->title_ = title.start_;
+  target->title_length_ = title.length_;
+  target->text_ = text.start_;
+  target->text_length_ = text.length_;
+  memcpy(target->options_, staged.options_, sizeof(staged.options_));
+  target->frame_ = NULL;
+  if (!(map->load_flags_ & LOAD_MAPPED))
+  {
+    renderChapterFrame(&map->text_arena_, target,
+                       isEndOption(option_files[0]), &error);
+  }
+  linkChapterOptions(target, &error);
+  for (size_t index = first_new_entry; index < map->count_; index++)
+  {
+    if (map->start_entry_[index].owns_value_)
+    {
+      linkChapterOptions(map->start_entry_[index].value_, &error);
+    }
+  }
+
+  // An editor may have replaced the file, so its FileIdentity changed
+  FileIdentity new_identity = getFileIdentity(path);
+  for (MapEntry *entry = map->start_entry_;
+       entry < map->start_entry_ + map->count_;
+       entry++)
+  {
+    if (entry->value_ == target)
+    {
+      entry->file_identity_ = new_identity;
+    }
+  }
+
+  // The parents of a split Chapter point to the copy until they are linked
+  // again by file name
+  Chapter **changed = (Chapter **) malloc((1 + chapter->parent_count_) *
+                                          sizeof(Chapter *));
+  size_t changed_count = 0;
+  if (changed == NULL)
+  {
+    error = ERR_OUT_OF_MEMORY;
+  }
+  else
+  {
+    changed[changed_count++] = target;
+  }
+  if (target != chapter && changed)
+  {
+    size_t parent_count = chapter->parent_count_;
+    memcpy(changed + 1, chapter->parents_, parent_count * sizeof(Chapter *));
+    for (size_t index = 1; index <= parent_count; index++)
+    {
+      if (relinkParentOptions(map, changed[index], &error))
+      {
+        changed[changed_count++] = changed[index];
+      }
+    }
+  }
+
+  createMapBuckets(map, map->bucket_count_, &error);
+  addEntryWatches(watcher, &error);
+  reanalyzeChapters(watcher, changed, changed_count, first_new_entry, &error);
+  free(changed);
+
+  GraphClass graph_class = getWatchedGraphClass(watcher, &error);
+  printf("[INFO] Reloaded %s.\n", path);
+  if (graph_class != watcher->graph_class_)
+  {
+    printGraphClass(graph_class);
+    watcher->graph_class_ = graph_class;
+  }
+  printError(error, path);
+  free(path);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Gives the entries of a split Chapter back to chapter after the reload
+/// failed.
+///
+/// @param map The Map of the Chapters.
+/// @param chapter The Chapter that was split.
+/// @param target The new Chapter of the changed file.
+/// @param owner_index The position of the entry which owned chapter.
+/// @param copy_index The position of the first entry of a copy.
+///
+/// @return nothing
+//
+void undoChapterSplit(Map *map, Chapter *chapter, Chapter *target,
+                      size_t owner_index, size_t copy_index)
+{
+  for (MapEntry *entry = map->start_entry_;
+       entry < map->start_entry_ + map->count_;
+       entry++)
+  {
+    if (entry->value_ == target)
+    {
+      entry->value_ = chapter;
+      entry->owns_value_ = 0;
+    }
+  }
+  map->start_entry_[copy_index].owns_value_ = 0;
+  map->start_entry_[owner_index].owns_value_ = 1;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Removes the entries from first_new_entry on from map, after loading them
+/// failed. Their Chapters may be incomplete and must not be found again.
+/// The indices of map have to be created again afterwards.
+///
+/// @param map The Map whose entries should be removed.
+/// @param first_new_entry The position of the first entry to remove.
+///
+/// @return nothing
+//
+void removeNewEntries(Map *map, size_t first_new_entry)
+{
+  for (size_t index = first_new_entry; index < map->count_; index++)
+  {
+    if (map->start_entry_[index].owns_value_)
+    {
+      freeChapterContent(map->start_entry_[index].value_);
+    }
+  }
+  map->count_ = first_new_entry;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Adds parent to the parent list of child.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param child The Chapter parent has an option to, can be NULL for ends.
+/// @param parent The parent Chapter.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void addGraphParent(Chapter *child, Chapter *parent, int *error)
+{
+  if (*error || child == NULL)
+  {
+    return;
+  }
+  if (child->parent_count_ >= child->parent_length_)
+  {
+    size_t length = child->parent_length_ ? child->parent_length_ * 2
+                                          : PARENT_MALLOC_INTERVALL;
+    Chapter **parents = (Chapter **) realloc(child->parents_,
+                                             length * sizeof(Chapter *));
+    if (parents == NULL)
+    {
+      *error = ERR_OUT_OF_MEMORY;
+      return;
+    }
+    child->parents_ = parents;
+    child->parent_length_ = length;
+  }
+  child->parents_[child->parent_count_++] = parent;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Removes parent once from the parent list of child.
+///
+/// @param child The Chapter parent had an option to, can be NULL for ends.
+/// @param parent The parent Chapter.
+///
+/// @return nothing
+//
+void removeGraphParent(Chapter *child, Chapter *parent)
+{
+  if (child == NULL)
+  {
+    return;
+  }
+  for (size_t index = 0; index < child->parent_count_; index++)
+  {
+    if (child->parents_[index] == parent)
+    {
+      child->parents_[index] = child->parents_[--child->parent_count_];
+      return;
+    }
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Adds chapter to the parent lists of its options.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param chapter The Chapter whose options should be linked.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void linkChapterOptions(Chapter *chapter, int *error)
+{
+  for (int option_index = 0; option_index < OPTION_COUNT; option_index++)
+  {
+    addGraphParent(chapter->options_[option_index], chapter, error);
+  }
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Resolves the option files of parent by name again and updates its options
+/// and their parent lists.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param map The Map containing the Chapters.
+/// @param parent The Chapter whose options should be resolved.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return 1 if an option of parent changed, else 0.
+//
+int relinkParentOptions(Map *map, Chapter *parent, int *error)
+{
+  int parse_error = 0;
+  StringView title;
+  StringView text;
+  StringView option_files[OPTION_COUNT];
+  getChapterPropertiesFromText(parent->content_, parent->content_length_,
+                               &title, &text, option_files, NULL,
+                               &parse_error);
+  if (parse_error || isEndOption(option_files[0]))
+  {
+    return 0;
+  }
+
+  int is_changed = 0;
+  for (int option_index = 0; option_index < OPTION_COUNT; option_index++)
+  {
+    Chapter *child = getChapterFromMap(map, option_files[option_index]);
+    if (child && child != parent->options_[option_index])
+    {
+      removeGraphParent(parent->options_[option_index], parent);
+      parent->options_[option_index] = child;
+      addGraphParent(child, parent, error);
+      is_changed = 1;
+    }
+  }
+  return is_changed;
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Analyzes the graph again after the options of the changed Chapters
+/// changed. Only the changed Chapters, their ancestors and the new Chapters
+/// can change their state, so only they are evaluated again. A Chapter
+/// leads to an end exactly if an end can be reached from it, so like in
+/// analyzeStoryGraphInParallel no components are needed: the evaluated
+/// Chapters with an end or a Chapter that leads to one as option are found
+/// first, then their parents breadth first. All other Chapters keep their
+/// state, so the StoryGraph is not needed.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param watcher The Watcher of the map.
+/// @param changed The Chapters whose options changed.
+/// @param changed_count The number of changed Chapters.
+/// @param first_new_entry The position of the first entry loaded for the
+/// change.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void reanalyzeChapters(Watcher *watcher, Chapter **changed,
+                       size_t changed_count, size_t first_new_entry,
+                       int *error)
+{
+  Map *map = watcher->map_;
+  if (*error)
+  {
+    return;
+  }
+  Chapter **nodes = (Chapter **) malloc(map->count_ * sizeof(Chapter *));
+  Chapter **queue = (Chapter **) malloc(map->count_ * sizeof(Chapter *));
+  if (nodes == NULL || queue == NULL)
+  {
+    free(nodes);
+    free(queue);
+    *error = ERR_OUT_OF_MEMORY;
+    return;
+  }
+
+  // Search the ancestors breadth first, graph_index_ marks found Chapters
+  size_t mark = SIZE_MAX - ++watcher->search_mark_;
+  size_t node_count = 0;
+  for (size_t index = 0; index < changed_count; index++)
+  {
+    if (changed[index]->graph_index_ != mark)
+    {
+      changed[index]->graph_index_ = mark;
+      nodes[node_count++] = changed[index];
+    }
+  }
+  for (size_t index = 0; index < node_count; index++)
+  {
+    Chapter *node = nodes[index];
+    for (size_t parent = 0; parent < node->parent_count_; parent++)
+    {
+      if (node->parents_[parent]->graph_index_ != mark)
+      {
+        node->parents_[parent]->graph_index_ = mark;
+        nodes[node_count++] = node->parents_[parent];
+      }
+    }
+  }
+  for (size_t index = first_new_entry; index < map->count_; index++)
+  {
+    MapEntry *entry = map->start_entry_ + index;
+    if (entry->owns_value_ && entry->value_->graph_index_ != mark)
+    {
+      entry->value_->graph_index_ = mark;
+      nodes[node_count++] = entry->value_;
+    }
+  }
+  countStatistic(&statistics.graph_visits_, node_count);
+
+  for (size_t index = 0; index < node_count; index++)
+  {
+    watcher->dead_end_count_ -= nodes[index]->graph_analyze_state_ == DEAD_END;
+    nodes[index]->graph_analyze_state_ = UNVISITED;
+  }
+  size_t queue_count = 0;
+  for (size_t index = 0; index < node_count; index++)
+  {
+    Chapter *node = nodes[index];
+    for (int option_index = 0; option_index < OPTION_COUNT; option_index++)
+    {
+      // NOTE: It is defined, that if one child is NULL, the node is an end
+      Chapter *child = node->options_[option_index];
+      if (!child || child->graph_analyze_state_ == LEADS_TO_END)
+      {
+        node->graph_analyze_state_ = LEADS_TO_END;
+        queue[queue_count++] = node;
+        break;
+      }
+    }
+  }
+  for (size_t index = 0; index < queue_count; index++)
+  {
+    Chapter *node = queue[index];
+    for (size_t parent = 0; parent < node->parent_count_; parent++)
+    {
+      Chapter *parent_node = node->parents_[parent];
+      if (parent_node->graph_index_ == mark &&
+          parent_node->graph_analyze_state_ == UNVISITED)
+      {
+        parent_node->graph_analyze_state_ = LEADS_TO_END;
+        queue[queue_count++] = parent_node;
+      }
+    }
+  }
+  for (size_t index = 0; index < node_count; index++)
+  {
+    if (nodes[index]->graph_analyze_state_ == UNVISITED)
+    {
+      nodes[index]->graph_analyze_state_ = DEAD_END;
+      watcher->dead_end_count_++;
+    }
+  }
+  free(nodes);
+  free(queue);
+}
+
+//-----------------------------------------------------------------------------
+///
+/// Classifies the watched graph like getGraphClass, but only for the
+/// Chapters reachable from the start, as changes can make Chapters
+/// unreachable. If there are DEAD_END Chapters, their ancestors are searched
+/// for the start, otherwise nothing has to be traversed.
+///
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
+///
+/// @param watcher The Watcher of the map.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return The GraphClass of the watched graph.
+//
+GraphClass getWatchedGraphClass(Watcher *watcher, int *error)
+{
+  Map *map = watcher->map_;
+  Chapter *root = map->start_entry_->value_;
+  if (root->graph_analyze_state_ != LEADS_TO_END)
+  {
+    return NO_END;
+  }
+  if (watcher->dead_end_count_ == 0 || *error)
+  {
+    return POSSIBLE;
+  }
+
+  Chapter **queue = (Chapter **) malloc(map->count_ * sizeof(Chapter *));
+  if (queue == NULL)
+  {
+    *error = ERR_OUT_OF_MEMORY;
+    return watcher->graph_class_;
+  }
+  size_t mark = SIZE_MAX - ++watcher->search_mark_;
+  size_t queue_count = 0;
+  for (MapEntry *entry = map->start_entry_;
+       entry < map->start_entry_ + map->count_;
+       entry++)
+  {
+    if (entry->owns_value_ && entry->value_->graph_analyze_state_ == DEAD_END
+        && entry->value_->graph_index_ != mark)
+    {
+      entry->value_->graph_index_ = mark;
+      queue[queue_count++] = entry->value_;
+    }
+  }
+
+  GraphClass graph_class = POSSIBLE;
+  for (size_t index = 0; index < queue_count && graph_class == POSSIBLE;
+       index++)
+  {
+    Chapter *node = queue[index];
+    for (size_t parent = 0; parent < node->parent_count_; parent++)
+    {
+      Chapter *parent_node = node->parents_[parent];
+      if (parent_node == root)
+      {
+        graph_class = HAS_MAZE;
+        break;
+      }
+      if (parent_node->graph_index_ != mark)
+      {
+        parent_node->graph_index_ = mark;
+        queue[queue_count++] = parent_node;
+      }
+    }
+  }
+  free(queue);
+  return graph_class;
+}
+
+/**
+ *
+ * Benchmark functions
+ *
+ */
+
+void parseStoryShape(char *, StoryShape *, int *);
+
+void writeGeneratedChapter(char *, size_t, size_t, size_t, StoryShape *,
+                           int *);
+
+unsigned long long nextRandom(unsigned long long *);
+
+void computeLayerStarts(StoryShape *, int *);
+
+void printBenchmarkPhase(char *, double, size_t, char *);
+
+//-----------------------------------------------------------------------------
+///
+/// Generates a synthetic story into directory, which is created if needed.
+/// The shape is a comma separated list of key=value pairs, missing keys keep
+/// their defaults:
+/// chapters=1000   The number of chapter files.
+/// depth=10        The number of layers, see computeLayerStarts. The last
+///                 one contains the ends.
+/// overlap=10      The percentage of Chapters whose options are the same.
+/// cycles=5        The percentage of options leading back to an earlier
+///                 Chapter.
+/// duplicates=5    The percentage of files with the same content as the
+///                 previous file of their layer. The Chapters only the
+///                 duplicate would lead to stay unreachable.
+/// text=100        The size of the text of every Chapter in bytes.
+/// seed=1          The seed of the random numbers.
+/// The chapter files are named c<index>.txt and the options are relative
+/// to directory, so the story has to be started from there with c0.txt.
+///
+/// Sets error to ERR_INVALID_ARGUMENTS if shape is invalid, ERR_WRITE if a
+/// file can't be written.
+///
+/// @param shape The shape of the story.
+/// @param directory The directory into which the story is written.
+/// @param error The error pointer that will be set if an error occurs.
+///
+/// @return nothing
+//
+void generateStory(char *shape, char *directory, int *error)
+{
+  StoryShape story_shape = {
+      .chapter_count_ = 1000,
+      .depth_ = 10,
+      .overlap_percent_ = 10,
+      .cycle_percent_ = 5,
+      .duplicate_percent_ = 5,
+      .text_size_ = 100,
+      .seed_ = 1,
+      .layer_starts_ = NULL
+  };
+  parseStoryShape(shape, &story_shape, error);
+  computeLayerStarts(&story_shape, error);
+  if (!*error && mkdir(directory, 0755) != 0 && errno != EEXIST)
+  {
+    *error = ERR_WRITE;
+    printError(*error, directory);
+  }
+
+  unsigned long long random_state = story_shape.seed_ | 1;
+  size_t original_index = 0;
+  size_t layer = 0;
+  for (size_t index = 0; index < story_shape.chapter_count_ && !*error;
+       index++)
+  {
+    while (index >= story_shape.layer_starts_[layer + 1])
+    {
+      layer++;
+    }
+    // Duplicates repeat title, options and text of the previous file
+    if (index == story_shape.layer_starts_[layer] ||
+        nextRandom(&random_state) % 100 >= story_shape.duplicate_percent_)
+    {
+      original_index = index;
+    }
+    writeGeneratedChapter(directory, index, original_index, layer,
+                          &story_shape, error);
   }
-
-  for (MapEntry *entry = options_map->start_entry_;
-       entry < options_map->start_entry_ + options_map->count_;
-       entry++)
+  if (!*error)
   {
-    clearSameChapterPointer(options_map, entry);
-    freeEntry(entry);
+    printf("[INFO] Generated %zu chapters, start with c0.txt in %s.\n",
+           story_shape.chapter_count_, directory);
   }
-  // Free chapter list
-  free(options_map->start_entry_);
+  free(story_shape.layer_starts_);
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Reads the file content of file and dynamically resize the file_buffer.
+/// Parses the key=value pairs of shape into story_shape.
 ///
-/// The error will be set to ERR_IO or ERR_OUT_OF_MEMORY if an error occurs.
+/// Sets error to ERR_INVALID_ARGUMENTS, if shape is invalid.
 ///
-/// @param file A pointer to an already opened file.
-/// @param file_buffer A pointer to an already allocated char array.
+/// @param shape The comma separated key=value pairs.
+/// @param story_shape The StoryShape which will be updated.
 /// @param error The error pointer that will be set if an error occurs.
 ///
 /// @return nothing
 //
-void readFile(FILE *file, char **file_buffer, int *error)
+void parseStoryShape(char *shape, StoryShape *story_shape, int *error)
 {
-  if (*error)
-  {
-    return;
-  }
-
-  size_t read = 0;
-  do
+  char *position = shape;
+  while (*position)
   {
-    read += fread(*file_buffer + read, 1, FILE_BUFFER_SIZE, file);
-    if (ferror(file))
+    char *value = strchr(position, '=');
+    char *number_end = NULL;
+    unsigned long long number = value ? strtoull(value + 1, &number_end, 10)
+                                      : 0;
+    if (value == NULL || number_end == value + 1 ||
+        (*number_end != ',' && *number_end != '\0'))
     {
-      *error = ERR_IO;
+      *error = ERR_INVALID_ARGUMENTS;
       return;
     }
-    if (feof(file))
+
+    size_t key_length = (size_t) (value - position);
+    if (key_length == 8 && strncmp(position, "chapters", 8) == 0 && number)
     {
-      char *temporary_file_buffer = (char *) realloc(*file_buffer, read + 1);
-      if (temporary_file_buffer == NULL)
-      {
-        *error = ERR_OUT_OF_MEMORY;
-        return;
-      }
-      // Set the null terminator for the string
-      *(temporary_file_buffer + read) = '\0';
-      *file_buffer = temporary_file_buffer;
-      return;
+      story_shape->chapter_count_ = number;
     }
-    char *temporary_file_buffer = (char *) realloc(*file_buffer,
-                                                   read + FILE_BUFFER_SIZE);
-    if (temporary_file_buffer == NULL)
+    else if (key_length == 5 && strncmp(position, "depth", 5) == 0 && number)
     {
-      *error = ERR_OUT_OF_MEMORY;
+      story_shape->depth_ = number;
+    }
+    else if (key_length == 7 && strncmp(position, "overlap", 7) == 0 &&
+             number <= 100)
+    {
+      story_shape->overlap_percent_ = (unsigned) number;
+    }
+    else if (key_length == 6 && strncmp(position, "cycles", 6) == 0 &&
+             number <= 100)
+    {
+      story_shape->cycle_percent_ = (unsigned) number;
+    }
+    else if (key_length == 10 && strncmp(position, "duplicates", 10) == 0 &&
+             number <= 100)
+    {
+      story_shape->duplicate_percent_ = (unsigned) number;
+    }
+    else if (key_length == 4 && strncmp(position, "text", 4) == 0)
+    {
+      story_shape->text_size_ = number;
+    }
+    else if (key_length == 4 && strncmp(position, "seed", 4) == 0)
+    {
+      story_shape->seed_ = number;
+    }
+    else
+    {
+      *error = ERR_INVALID_ARGUMENTS;
       return;
     }
-    *file_buffer = temporary_file_buffer;
-  } while (1);
-}
+    position = *number_end ? number_end + 1 : number_end;
+  }
 
-// This would be a possibility to ensure every file is only read once, no matter
-// if the given path is relative, absolute or a symlink.
-// However, this would need the POSIX standard, and is not allowed for the
-// Assignment.
-////----------------------------------------------------------------------------
-/////
-///// Normalizes the filename e.g. converts it to the absolute path.
-/////
-///// @param filename The filename that should be normalized.
-///// @param error The error pointer that will be set if an error occurs.
-/////
-///// @return The normalized filename.
-////
-//char *normalizeFilename(char *filename, int *error)
-//{
-//  if (*error)
-//  {
-//    return NULL;
-//  }
-//  char *absolute_path = realpath(filename, NULL);
-//  if (absolute_path == NULL)
-//  {
-//    switch (errno)
-//    {
-//      case ENOMEM:
-//        *error = ERR_OUT_OF_MEMORY;
-//        break;
-//      default:
-//        *error = ERR_IO;
-//    }
-//    return NULL;
-//  }
-//  return absolute_path;
-//}
+  if (story_shape->depth_ > story_shape->chapter_count_)
+  {
+    story_shape->depth_ = story_shape->chapter_count_;
+  }
+}
 
 //-----------------------------------------------------------------------------
 ///
-/// Loads the file content and puts it onto text.
+/// Writes the chapter file c<index>.txt of a generated story. Its content is
+/// the one of Chapter original_index, which is index unless the file is a
+/// duplicate. Its random numbers are seeded with the original index, so a
+/// duplicate repeats the original content exactly.
 ///
-/// The error will be set to ERR_IO or ERR_OUT_OF_MEMORY if an error occurs.
+/// Sets error to ERR_WRITE, if the file can't be written.
 ///
-/// @param filename The file from which the text should be loaded.
-/// @param text The reference to the pointer on which the text will be
-/// accessible.
+/// @param directory The directory of the story.
+/// @param index The index of the file.
+/// @param original_index The index of the Chapter whose content is written.
+/// @param layer The layer of both Chapters.
+/// @param story_shape The shape of the story.
 /// @param error The error pointer that will be set if an error occurs.
 ///
 /// @return nothing
 //
-void loadChapterText(char *filename, char **text, int *error)
+void writeGeneratedChapter(char *directory, size_t index,
+                           size_t original_index, size_t layer,
+                           StoryShape *story_shape, int *error)
 {
-  if (*error)
+  char path[GENERATOR_PATH_SIZE];
+  snprintf(path, sizeof(path), "%s/c%zu.txt", directory, index);
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
   {
+    *error = ERR_WRITE;
+    printError(*error, path);
     return;
   }
 
-  FILE *file = fopen(filename, "r");
-  if (file == NULL)
+  unsigned long long chapter_random =
+      (original_index + 1) * 0x9E3779B97F4A7C15ULL ^ story_shape->seed_;
+  chapter_random |= 1;
+  fprintf(file, "Chapter %zu\n", original_index);
+  if (layer + 1 >= story_shape->depth_)
   {
-    *error = ERR_IO;
-    return;
+    fprintf(file, "-\n-\n");
   }
-
-  createCharArray(text, FILE_BUFFER_SIZE, error);
-
-  readFile(file, text, error);
-  fclose(file);
-  if (*error)
+  else
   {
-    if (*text)
+    // The options spread the layer evenly over the next one, so every
+    // Chapter is reachable unless the next layer is more than twice as
+    // large
+    size_t layer_start = story_shape->layer_starts_[layer];
+    size_t next_start = story_shape->layer_starts_[layer + 1];
+    size_t layer_length = next_start - layer_start;
+    size_t next_length = story_shape->layer_starts_[layer + 2] - next_start;
+    size_t slot = 2 * (original_index - layer_start);
+    size_t option_a = next_start + slot * next_length / (2 * layer_length);
+    size_t option_b = next_start + (slot + 1) * next_length /
+                                   (2 * layer_length);
+    unsigned roll = (unsigned) (nextRandom(&chapter_random) % 100);
+    if (roll < story_shape->cycle_percent_)
     {
-      free(*text);
+      option_b = nextRandom(&chapter_random) % next_start;
     }
-    return;
+    else if (roll < story_shape->cycle_percent_ +
+                    story_shape->overlap_percent_)
+    {
+      option_b = option_a;
+    }
+    fprintf(file, "c%zu.txt\nc%zu.txt\n", option_a, option_b);
+  }
+  for (size_t position = 0; position < story_shape->text_size_; position++)
+  {
+    unsigned letter = (unsigned) (nextRandom(&chapter_random) % 27);
+    fputc(letter == 26 ? ' ' : 'a' + (int) letter, file);
+  }
+  fputc('\n', file);
+
+  if (fclose(file) != 0)
+  {
+    *error = ERR_WRITE;
+    printError(*error, path);
   }
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Allocates memory for a char array of size size.
-/// If the allocation fails, the size will be halfed until the size is 1 and
-/// then returns 0 and sets the error to ERR_OUT_OF_MEMORY.
+/// Returns the next number of a xorshift random number generator, so
+/// generated stories are the same on every platform.
 ///
-/// @param array The reference to the pointer on which the created array should
-/// be accessible.
-/// @param size The initial size of the created array.
-/// @param error The error pointer that will be set if an error occurs.
+/// @param state The state of the generator, not 0.
 ///
-/// @return nothing
+/// @return The next random number.
 //
-size_t createCharArray(char **array, size_t size, int *error)
+unsigned long long nextRandom(unsigned long long *state)
 {
-  while (1)
-  {
-    *array = (char *) malloc(size);
-    if (*array != NULL)
-    {
-      return size;
-    }
-
-    if (size == 1)
-    {
-      *error = ERR_OUT_OF_MEMORY;
-      return 0;
-    }
-    size /= 2;
-  }
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Searches for the first '\n' in text and replaces it with a null terminator.
-/// Sets the pointer in text to the character after the replaced position.
+/// Splits the Chapters of story_shape into layers. The first layer only
+/// contains the start Chapter, every further layer is at most twice as large
+/// as the previous one, so it can be fully reached, and the remaining
+/// Chapters are split evenly. The last layer takes the rest, which may be
+/// only partly reachable if the story is too shallow for its Chapters.
 ///
-/// Sets error to ERR_IO if no '\n' was found, or if the position after the
-/// replaced character is not in the text.
+/// Sets error to ERR_OUT_OF_MEMORY, if allocation fails.
 ///
-/// @param text The text in which the '\n' should be relaced with a null
-/// terminator.
+/// @param story_shape The StoryShape whose layer_starts_ will be set.
 /// @param error The error pointer that will be set if an error occurs.
 ///
 /// @return nothing
 //
-void findAndReplaceNewLine(char **text, int *error)
+void computeLayerStarts(StoryShape *story_shape, int *error)
 {
   if (*error)
   {
     return;
   }
-  *text = strchr(*text, '\n');
-  if (*text == NULL)
+
+  size_t depth = story_shape->depth_;
+  story_shape->layer_starts_ = malloc((depth + 1) * sizeof(size_t));
+  if (story_shape->layer_starts_ == NULL)
   {
-    *error = ERR_IO;
+    *error = ERR_OUT_OF_MEMORY;
     return;
   }
-  **text = '\0';
-  ++*text;
-  if (*text == NULL)
+
+  size_t layer_start = 0;
+  size_t layer_length = 1;
+  for (size_t layer = 0; layer < depth; layer++)
   {
-    *error = ERR_IO;
-    return;
+    story_shape->layer_starts_[layer] = layer_start;
+    size_t remaining_count = story_shape->chapter_count_ - layer_start;
+    size_t remaining_layers = depth - layer;
+    if (layer > 0)
+    {
+      size_t even_length = (remaining_count + remaining_layers - 1) /
+                           remaining_layers;
+      layer_length = even_length < 2 * layer_length ? even_length
+                                                    : 2 * layer_length;
+    }
+    if (remaining_layers == 1 || layer_length > remaining_count)
+    {
+      layer_length = remaining_count;
+    }
+    layer_start += layer_length;
   }
+  story_shape->layer_starts_[depth] = story_shape->chapter_count_;
 }
 
+
 //-----------------------------------------------------------------------------
 ///
-/// Frees the memory of the given MapEntry.
+/// Loads, analyzes, plays and frees a story and prints how long each phase
+/// took, the throughput and the memory used. The turns are played with
+/// random choices and without output, every end starts the story again.
 ///
-/// @param chapter A MapEntry* that should be freed. Can be NULL.
+/// @param options_map The not yet initialized Map for the story.
+/// @param arguments The parsed command line arguments.
+/// @param error The error pointer that will be set if an error occurs.
 ///
 /// @return nothing
 //
-void freeEntry(MapEntry *entry)
+void runBenchmark(Map *options_map, Arguments *arguments, int *error)
 {
-  if (!entry)
+  Chapter *start_chapter = NULL;
+  double start_time = getSeconds();
+  initializeWithFile(arguments->start_file_, options_map, &start_chapter,
+                     error);
+  double load_time = getSeconds();
+
+  analyzeGameGraph(options_map, error);
+  double analysis_time = getSeconds();
+
+  size_t turn_count = 0;
+  size_t ending_count = 0;
+  StoryGraph *graph = &options_map->graph_;
+  if (!*error && graph->edge_starts_[1])
   {
-    return;
+    unsigned long long random_state = 0x2545F4914F6CDD1DULL;
+    uint32_t node = 0;
+    for (; turn_count < arguments->benchmark_turn_count_; turn_count++)
+    {
+      uint32_t first_edge = graph->edge_starts_[node];
+      uint32_t edge_count = graph->edge_starts_[node + 1] - first_edge;
+      node = graph->edges_[first_edge +
+                           nextRandom(&random_state) % edge_count];
+      if (graph->edge_starts_[node] == graph->edge_starts_[node + 1])
+      {
+        node = 0;
+        ending_count++;
+      }
+    }
   }
-  freeChapter(entry->value_);
-}
+  double play_time = getSeconds();
 
-//-----------------------------------------------------------------------------
-///
-/// Frees the memory of the given Chapter.
-///
-/// @param chapter A Chapter* that should be freed. Can be NULL.
-///
-/// @return nothing
-//
-void freeChapter(Chapter *chapter)
-{
-  if (!chapter)
+  uint32_t shortest_distance = *error ? NO_END_DISTANCE :
+                               graph->end_distances_[0];
+  size_t file_count = options_map->count_;
+  size_t chapter_count = 0;
+  for (size_t index = 0; index < file_count; index++)
+  {
+    chapter_count += options_map->start_entry_[index].owns_value_ != 0;
+  }
+  freeMap(options_map);
+  double teardown_time = getSeconds();
+  if (*error)
   {
     return;
   }
 
-  if (chapter->title_)
+  printBenchmarkPhase("load", load_time - start_time, file_count, "files");
+  printf("[BENCH] dedup     %zu unique chapters, %zu duplicate files\n",
+         chapter_count, file_count - chapter_count);
+  printBenchmarkPhase("analysis", analysis_time - load_time, chapter_count,
+                      "chapters");
+  printBenchmarkPhase("play", play_time - analysis_time, turn_count,
+                      "turns");
+  printf("[BENCH] endings   %zu\n", ending_count);
+  if (shortest_distance != NO_END_DISTANCE)
   {
-    free(chapter->title_);
+    printf("[BENCH] shortest  %u choices from the start to an end\n",
+           shortest_distance);
   }
-  free(chapter);
+  printBenchmarkPhase("teardown", teardown_time - play_time, chapter_count,
+                      "chapters");
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("[BENCH] memory    %ld KiB maximum resident\n", usage.ru_maxrss);
 }
 
+
 //-----------------------------------------------------------------------------
 ///
-/// Prints an error message for the given error_code.
+/// Prints the duration and throughput of a benchmark phase.
 ///
-/// @param error_code The error code for which an error message should be
-/// printed.
-/// @param argument char argument for error code ERR_IO, to provide the file
-/// for which the message should be printed. If NULL, the ERR_IO will not be
-/// printed.
+/// @param phase The name of the phase.
+/// @param seconds The duration of the phase.
+/// @param count The number of processed items.
+/// @param unit The name of the items.
 ///
 /// @return nothing
 //
-void printError(const int error_code, char *argument)
+void printBenchmarkPhase(char *phase, double seconds, size_t count,
+                         char *unit)
 {
-  switch (error_code)
-  {
-    case ERR_INVALID_ARGUMENTS:
-      printf("Usage: ./ass2 [file-name]\n");
-      break;
-    case ERR_IO:
-      if (argument)
-      {
-        printf("[ERR] Could not read file %s.\n", argument);
-      }
-      break;
-    case ERR_OUT_OF_MEMORY:
-      printf("[ERR] Out of memory.\n");
-      break;
-    default:
-      return;
-  }
-
+  printf("[BENCH] %-9s %10.3f ms  %zu %s  %.0f %s/s\n", phase,
+         seconds * 1e3, count, unit, seconds > 0 ? count / seconds : 0.0,
+         unit);
 }
 
 /**
  *
- * Graph functions
+ * Statistics functions
  *
  */
 
-typedef enum _GraphClass_
-{
-  POSSIBLE = 1,
-  HAS_MAZE = 2,
-  NO_END = 0
-} GraphClass;
-
-GraphNodeStatus evaluateGraphNode(Chapter *root);
-
-void resetGraphState(Map *);
-
-void traverseGraph(Chapter *);
-
-void visitGraphChilds(Chapter *);
-
-void visitRemainingChilds(Chapter *);
-
-GraphClass getGraphClass(Map *);
-
 //-----------------------------------------------------------------------------
 ///
-/// Analyzes the Graph represented by the Chapter.
-/// It will be analyzed if the Graph:
-/// - Contains loops
-///   - If the loop can be exited
-/// - Has an end
-///
-/// @param map The map containing all Chapters/the Graph to analyze.
-/// @param error The error pointer that will be set if an error occurs.
+/// Starts timing a phase, if statistics are enabled.
 ///
 /// @return nothing
 //
-void analyzeGameGraph(Map *map, int *error)
+void startPhase()
 {
-  if (*error)
-  {
-    return;
-  }
-
-  resetGraphState(map);
-
-  // Traverse graph and analyze each node
-  Chapter *root = map->start_entry_->value_;
-  traverseGraph(root);
-
-  // Iterate through map and evaluate the current loaded adventure
-  GraphClass result = getGraphClass(map);
-  switch (result)
+  if (statistics.enabled_)
   {
-    case NO_END:
-      // This also implies that there is a circle
-      printf("[INFO] The loaded adventure has no reachable end!\n");
-      break;
-
-    case HAS_MAZE:
-      // This also implies that there is a circle, that you can't get out of.
-      printf(
-          "[INFO] The loaded adventure contains a path that leads to a maze,"
-              " that can't be exited anymore!\n");
-      break;
-
-    default:
-      break;
+    statistics.phase_start_wall_ = getSeconds();
+    statistics.phase_start_cpu_ = getCpuSeconds();
   }
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Resets the graph_analyze_state of every Chapter/graph node in the map.
+/// Adds the time since the last startPhase or finishPhase to phase and
+/// starts timing the next phase, if statistics are enabled.
 ///
-/// @param map The map containing all Chapters/the Graph to analyze.
+/// @param phase The phase which just finished.
 ///
 /// @return nothing
 //
-void resetGraphState(Map *map)
+void finishPhase(StatisticsPhase phase)
 {
-  for (MapEntry *entry = map->start_entry_;
-       entry < map->start_entry_ + map->count_;
-       entry++)
+  if (!statistics.enabled_)
   {
-    // init graph analysis state
-    entry->value_->graph_analyze_state_ = UNVISITED;
+    return;
   }
+  double wall_time = getSeconds();
+  double cpu_time = getCpuSeconds();
+  statistics.wall_seconds_[phase] += wall_time - statistics.phase_start_wall_;
+  statistics.cpu_seconds_[phase] += cpu_time - statistics.phase_start_cpu_;
+  statistics.measured_phases_ |= 1u << phase;
+  statistics.phase_start_wall_ = wall_time;
+  statistics.phase_start_cpu_ = cpu_time;
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Checks the state of root and commence further actions depending on the
-/// state:
-/// - VISITED No Action needed
-/// - DEAD_END No Action needed
-/// - PROCESSING Start exploring the alternate childs
-/// - UNVISITED Start exploring all childs
+/// Adds amount to counter, if statistics are enabled.
 ///
-/// @param root The graph node/Chapter whichs sub tree should be analyzed.
+/// @param counter The counter of statistics.
+/// @param amount The amount to add.
 ///
 /// @return nothing
 //
-void traverseGraph(Chapter *root)
+void countStatistic(atomic_size_t *counter, size_t amount)
 {
-  switch (root->graph_analyze_state_)
+  if (statistics.enabled_)
   {
-    case LEADS_TO_END:
-    case DEAD_END:
-      // Skip node evaluation
-      return;
-
-    case PROCESSING:
-      // Explore alternate paths on graph nodes
-      visitRemainingChilds(root);
-      break;
-
-    case UNVISITED:
-    default:
-      // Normally process graph node
-      root->graph_analyze_state_ = PROCESSING;
-      visitGraphChilds(root);
+    atomic_fetch_add_explicit(counter, amount, memory_order_relaxed);
   }
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Visits all childs of root and either goes deeper down the graph, or sets
-/// the state to VISITED, if the root has a null child.
-///
-/// NOTE: It is defined, that if one child is NULL, there are no other childs
-/// in this root.
-///
-/// @param root The graph node/Chapter whichs childs should be analyzed.
+/// Prints the wall and CPU time of the measured phases and the counters to
+/// stderr, if statistics are enabled. stdout stays as specified.
 ///
 /// @return nothing
 //
-void visitGraphChilds(Chapter *root)
+void printStatistics()
 {
-  for (int current_path = 0; current_path < OPTION_COUNT; current_path++)
+  if (!statistics.enabled_)
   {
-    Chapter *child = root->options_[current_path];
-    if (child != NULL)
-    {
-      // Recursively traverse graph
-      traverseGraph(child);
-    }
-    else
-    {
-      // Node is an end node
-      root->graph_analyze_state_ = LEADS_TO_END;
-      return;
-    }
+    return;
   }
-  // Evaluate node status
-  root->graph_analyze_state_ = evaluateGraphNode(root);
-}
 
-//-----------------------------------------------------------------------------
-///
-/// Evaluates if root lead to an end or if it is a DEAD_END.
-///
-/// NOTE: During processing of the whole graph DEAD_END could be temporary.
-///
-/// @param root The graph node/Chapter which should be evaluated.
-///
-/// @return The freshly evaluated state for root.(LEADS_TO_END or DEAD_END)
-//
-GraphNodeStatus evaluateGraphNode(Chapter *root)
-{
-  for (int current_path = 0; current_path < OPTION_COUNT; current_path++)
+  static char *phase_names[PHASE_COUNT] = {
+      "load", "analysis", "compression", "play", "teardown"
+  };
+  fprintf(stderr, "[STATS] %-17s %12s %12s\n", "phase", "wall ms", "cpu ms");
+  for (int phase = 0; phase < PHASE_COUNT; phase++)
   {
-    Chapter *child = root->options_[current_path];
-    // Node is connected to a node that leads to an end
-    if (child->graph_analyze_state_ == LEADS_TO_END)
+    if (statistics.measured_phases_ & (1u << phase))
     {
-      return LEADS_TO_END;
+      fprintf(stderr, "[STATS] %-17s %12.3f %12.3f\n", phase_names[phase],
+              statistics.wall_seconds_[phase] * 1e3,
+              statistics.cpu_seconds_[phase] * 1e3);
     }
   }
-  // Mark node as dead end to reduce further recursion
-  return DEAD_END;
+  fprintf(stderr, "[STATS] %-17s %12zu\n", "files opened",
+          atomic_load(&statistics.files_opened_));
+  fprintf(stderr, "[STATS] %-17s %12zu\n", "bytes read",
+          atomic_load(&statistics.bytes_read_));
+  fprintf(stderr, "[STATS] %-17s %12zu\n", "read resizes",
+          atomic_load(&statistics.read_resizes_));
+  fprintf(stderr, "[STATS] %-17s %12zu\n", "map probes",
+          atomic_load(&statistics.map_probes_));
+  fprintf(stderr, "[STATS] %-17s %12zu\n", "identity hits",
+          atomic_load(&statistics.identity_hits_));
+  fprintf(stderr, "[STATS] %-17s %12zu\n", "content compares",
+          atomic_load(&statistics.content_compares_));
+  fprintf(stderr, "[STATS] %-17s %12zu\n", "graph visits",
+          atomic_load(&statistics.graph_visits_));
+  fprintf(stderr, "[STATS] %-17s %12zu\n", "text stored",
+          atomic_load(&statistics.text_stored_));
+  fprintf(stderr, "[STATS] %-17s %12zu\n", "text compressed",
+          atomic_load(&statistics.text_compressed_));
+  fprintf(stderr, "[STATS] %-17s %12zu\n", "block decodes",
+          atomic_load(&statistics.block_decodes_));
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Visits all childs of root and either goes deeper down the graph, or sets
-/// the state to VISITED, if the root has a null child.
-///
-/// @param root The graph node/Chapter whichs childs should be analyzed.
+/// Returns the time of a monotonic clock.
 ///
-/// @return nothing
+/// @return The time in seconds.
 //
-void visitRemainingChilds(Chapter *root)
+double getSeconds()
 {
-  for (int current_path = OPTION_COUNT - 1; current_path > 0; current_path--)
-  {
-    Chapter *child = root->options_[current_path];
-    // Node is connected to a node that leads to an end
-    if (!child || child->graph_analyze_state_ == LEADS_TO_END)
-    {
-      root->graph_analyze_state_ = LEADS_TO_END;
-      return;
-    }
-    // Visit unvisited children
-    if (child->graph_analyze_state_ == UNVISITED)
-    {
-      traverseGraph(child);
-    }
-  }
-  // Evaluate node status
-  root->graph_analyze_state_ = evaluateGraphNode(root);
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
 }
 
 //-----------------------------------------------------------------------------
 ///
-/// Classifies a graph represented by a Chapter map according to it's
-/// properties.
+/// Returns the CPU time used by the process, including all threads.
 ///
-/// @param map The map containing the Chapter graph.
-///
-/// @return The GraphClass of the Graph in map
+/// @return The time in seconds.
 //
-GraphClass getGraphClass(Map *map)
+double getCpuSeconds()
 {
-  Chapter *root = map->start_entry_->value_;
-  // Root has no child Chapter that leads to an end, that implies that there
-  // exists no reachable end in this adventure
-  if (root->graph_analyze_state_ != LEADS_TO_END)
-  {
-    return NO_END;
-  }
-
-  // Iterate through map and look at every visited node, if a single not wasn't
-  // visited that implies that there must be a inescapable maze
-  for (MapEntry *entry = map->start_entry_;
-       entry < map->start_entry_ +
-               map->count_; entry++)
-  {
-    if (entry->value_->graph_analyze_state_ != LEADS_TO_END)
-    {
-      return HAS_MAZE;
-    }
-  }
-  // If every chapter can reach an end, that means that the adventure is
-  // possible to play, every circle has at least one possible way
-  // that leads to an end
-  return POSSIBLE;
-}
\ No newline at end of file
+  struct timespec time;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+  return (double) time.tv_sec + (double) time.tv_nsec / 1e9;
+}